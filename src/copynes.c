@@ -27,27 +27,84 @@
 #include <termios.h>		/* POSIX compiant terminal I/O bits */
 #include <string.h>
 #include <arpa/inet.h>
+#include <time.h>
 #include <sys/time.h>
 #include <sys/types.h>
 #include <sys/select.h> 
 #include <sys/ioctl.h>
 #include <sys/termios.h>	/* platform specific terminal I/O bits */
+#include <pthread.h>
+#if defined __linux__
+#include <sys/eventfd.h>
+#endif
+#if defined COPYNES_HAVE_SDT
+#define _SDT_HAS_SEMAPHORES 1
+#include <sys/sdt.h>
+#endif
 
 #include "copynes.h"
+#include "copynes_private.h"
 
 #define _POSIX_SOURCE 1
 
-#define KB(x) (x * 1024)
+/* once select says the data channel is readable, batch reads give the
+   rest of the request (up to BATCH_MAX bytes) BATCH_WAIT_USEC to show up
+   before reading it all at once.  VMIN/VTIME can't do this for us, they
+   need a blocking fd and select wakes on the first byte regardless */
+#define BATCH_MAX				KB(1)
+#define BATCH_WAIT_USEC			1000
+
+/* where the code starts in a plugin .bin, after the header */
+#define PLUGIN_PRG_OFFSET		128
+
+/* static tracepoints.  with sys/sdt.h these are USDT probes of the "copynes"
+   provider: a nop each, and the timing behind them is skipped, until a
+   tracer such as bpftrace or perf attaches.  without it they are compiled
+   out.  the probes are
+
+     packet_state(cn, from, to, bytes)		read packet state machine
+     read_start(cn, count)
+     read(cn, count, ret, nsec)
+     write(cn, size, ret, nsec)
+     plugin_load(cn, path, ret, nsec)		path is 0 for an image or a reload
+     plugin_run(cn, ret)
+     reset(cn, mode, step)					one of the TRACE_RESET_* steps */
+#if defined COPYNES_HAVE_SDT
+#define TRACE_SEMAPHORE(name)	unsigned short copynes_##name##_semaphore __attribute__((used, section(".probes")))
+#define TRACE_ACTIVE(name)		__builtin_expect(copynes_##name##_semaphore != 0, 0)
+#define TRACE2(name, a, b)				DTRACE_PROBE2(copynes, name, a, b)
+#define TRACE3(name, a, b, c)			DTRACE_PROBE3(copynes, name, a, b, c)
+#define TRACE4(name, a, b, c, d)		DTRACE_PROBE4(copynes, name, a, b, c, d)
+
+TRACE_SEMAPHORE(packet_state);
+TRACE_SEMAPHORE(read_start);
+TRACE_SEMAPHORE(read);
+TRACE_SEMAPHORE(write);
+TRACE_SEMAPHORE(plugin_load);
+TRACE_SEMAPHORE(plugin_run);
+TRACE_SEMAPHORE(reset);
+#else
+/* the arguments are still seen by the compiler, only never evaluated, so
+   values kept just for a probe don't turn into unused variables */
+#define TRACE_ACTIVE(name)		0
+#define TRACE2(name, a, b)				do { if(0) { (void)(a); (void)(b); } } while(0)
+#define TRACE3(name, a, b, c)			do { if(0) { (void)(a); (void)(b); (void)(c); } } while(0)
+#define TRACE4(name, a, b, c, d)		do { if(0) { (void)(a); (void)(b); (void)(c); (void)(d); } } while(0)
+#endif
+
+/* copynes_reset steps */
+#define TRACE_RESET_MODE		0		/* /RTS set for the mode */
+#define TRACE_RESET_LOW			1		/* /RESET pulled low */
+#define TRACE_RESET_HIGH		2		/* /RESET released */
+#define TRACE_RESET_FLUSH		3		/* settled and flushed */
+#define TRACE_RESET_DONE		4
 
-/* error codes */
-#define FAILED_DATA_OPEN 		1
-#define FAILED_CONTROL_OPEN 	2
-#define FAILED_COMMAND_SEND 	3
-#define FAILED_PLUGIN_OPEN 		4
-#define FAILED_BLOCK_SEND		5
-#define FAILED_DATA_READ		6
-#define FAILED_INVALID_PARAMS	7
-#define FAILED_DATA_WRITE		8
+/* the smallest mirror we look for, iNES counts PRG in 16K and CHR in 8K
+   units, and how many copies of it have to come in before MIRROR_STOP
+   believes it */
+#define MIRROR_MIN_PRG			KB(16)
+#define MIRROR_MIN_CHR			KB(8)
+#define MIRROR_STOP_COPIES		4
 
 char *errors[] =
 {
@@ -59,7 +116,11 @@ char *errors[] =
 	"failed to send a block of data",
 	"failed to read from data channel",
 	"passed invalid parameters to library function",
-	"failed to write data to the data channel"
+	"failed to write data to the data channel",
+	"the requested I/O engine is not available",
+	"not enough memory for the packet data",
+	"the operation was cancelled",
+	"the dump was stopped before its last packet"
 };
 
 /* protocol commands */
@@ -69,59 +130,88 @@ uint8_t CMD_RUN_PLUGIN[] =		{ 0x7e, 0x00, 0x04, 0x00, 0xe7 };
 
 #define CMD_SIZE(x) (sizeof(x) / sizeof(x[0]))
 
-/* CopyNES state */
-struct copynes_s
-{
-	int data;
-	int control;
-    int status;
-	int err;
-	int rbyte;
-	int rcount;
-	char* data_device;
-	char* control_device;
-	char* current_plugin;
-	fd_set readfds;
-	fd_set exceptfds;
-	uint8_t uservar_enabled[4];
-	uint8_t uservar_value[4];
-	struct termios old_tios_data_device;
-	struct termios old_tios_control_device;
-};
-
 /* private interface function declarations */
 static void copynes_get_status(copynes_t cn);
 static void copynes_set_status(copynes_t cn);
 static void copynes_configure_tios(struct termios * tios); /* used by copynes_configure_devices */
 static void copynes_configure_devices(copynes_t cn);
+static int copynes_batch_wait(copynes_t cn, size_t want, struct timeval* timeout);
+static int copynes_sleep(copynes_t cn, int usec);
+static int copynes_mirror_check(const uint8_t* data, int end, int size);
+static ssize_t copynes_read_data(copynes_t cn, void* buf, size_t count, struct timeval *timeout);
+static ssize_t copynes_write_data(copynes_t cn, void* buf, size_t size);
+static int copynes_load_plugin_traced(copynes_t cn, const char* plugin, const void* image, size_t size);
+static int copynes_load_plugin_data(copynes_t cn, const char* plugin, const void* image, size_t size);
+static uint64_t copynes_trace_clock();
+
 
+#if defined COPYNES_NO_HEAP
+/* the caller's storage has to hold the handle */
+typedef char copynes_storage_check[(sizeof(struct copynes_s) <= sizeof(copynes_storage_t)) ? 1 : -1];
 
+copynes_t copynes_new_static(copynes_storage_t* storage)
+{
+	memset(storage, 0, sizeof(struct copynes_s));
+	return (copynes_t)storage;
+}
+#else
 copynes_t copynes_new()
 {
     return (copynes_t)calloc(1, sizeof(struct copynes_s));
 }
+#endif
 
 
 void copynes_free(void* cn)
 {
     copynes_close((copynes_t)cn);
+#if !defined COPYNES_NO_HEAP
     free(cn);
+#endif
 }
 
 
 /* initialize/deinitialize the copy nes device */
 int copynes_open(copynes_t cn, const char* data_device, const char* control_device)
 {
-    /* clear the struct memory */
-    memset(cn, 0, sizeof(copynes_t));
+	return copynes_open_engine(cn, data_device, control_device, IO_ENGINE_SELECT, 0);
+}
+
+
+int copynes_open_engine(copynes_t cn, const char* data_device, const char* control_device, int engine, copynes_ring_t ring)
+{
+    copynes_cancel_t cancel = cn->cancel;
+    
+    /* clear the struct memory, a cancel handle set before opening stays */
+    memset(cn, 0, sizeof(struct copynes_s));
+    cn->cancel = cancel;
     
     /* store the device strings */
+#if defined COPYNES_NO_HEAP
+    if((strlen(data_device) >= COPYNES_PATH_MAX) || (strlen(control_device) >= COPYNES_PATH_MAX))
+    {
+        cn->err = FAILED_INVALID_PARAMS;
+        return -cn->err;
+    }
+    strcpy(cn->data_device, data_device);
+    strcpy(cn->control_device, control_device);
+#else
     cn->data_device = strdup(data_device);
     cn->control_device = strdup(control_device);
+#endif
     cn->uservar_enabled[0] = 0;
     cn->uservar_enabled[1] = 0;
     cn->uservar_enabled[2] = 0;
     cn->uservar_enabled[3] = 0;
+    cn->read_mode = READ_MODE_POLL;
+    cn->engine = IO_ENGINE_SELECT;
+    memset(&cn->uring, 0, sizeof(cn->uring));
+
+    if((engine != IO_ENGINE_SELECT) && (engine != IO_ENGINE_URING))
+    {
+        cn->err = FAILED_INVALID_PARAMS;
+        return -cn->err;
+    }
 
     /* try to open the data channel */
     cn->data = open(cn->data_device, O_RDWR  | O_NOCTTY | O_NDELAY);
@@ -147,12 +237,41 @@ int copynes_open(copynes_t cn, const char* data_device, const char* control_devi
     /* flush the buffers */
     copynes_flush(cn);
     
+    /* hook the data channel up to the io_uring */
+    if(engine == IO_ENGINE_URING)
+    {
+#ifdef COPYNES_HAVE_IO_URING
+        if(copynes_uring_attach(cn, ring) < 0)
+        {
+            cn->err = FAILED_IO_ENGINE;
+            return -cn->err;
+        }
+        cn->engine = IO_ENGINE_URING;
+#else
+        (void)ring;
+        cn->err = FAILED_IO_ENGINE;
+        return -cn->err;
+#endif
+    }
+    
     return 0;
 }
 
 
 void copynes_close(copynes_t cn)
 {
+#if !defined COPYNES_NO_HEAP
+	/* the reader thread must be gone before its fd is */
+	copynes_reader_stop(cn);
+#endif
+	
+#ifdef COPYNES_HAVE_IO_URING
+	/* wait out anything still queued against the data channel */
+	if(cn->engine == IO_ENGINE_URING)
+		copynes_uring_detach(cn);
+	cn->engine = IO_ENGINE_SELECT;
+#endif
+
 	/* reset the termios settings */
 	tcsetattr(cn->data, TCSAFLUSH, &cn->old_tios_data_device);
 	tcsetattr(cn->control, TCSAFLUSH, &cn->old_tios_control_device);
@@ -161,13 +280,13 @@ void copynes_close(copynes_t cn)
     close(cn->data);
     close(cn->control);
 	
+#if !defined COPYNES_NO_HEAP
 	/* free up the strings */
     if(cn->data_device != 0)
         free(cn->data_device);
     if(cn->control_device != 0)
         free(cn->control_device);
-	if(cn->current_plugin != 0)
-		free(cn->current_plugin);
+#endif
 }
 
 
@@ -188,6 +307,7 @@ int copynes_reset(copynes_t cn, int mode)
         cn->status |= TIOCM_RTS;
         copynes_set_status(cn);
     }
+    TRACE3(reset, cn, mode, TRACE_RESET_MODE);
     
     if(!(mode & RESET_NORESET))
     {
@@ -196,7 +316,9 @@ int copynes_reset(copynes_t cn, int mode)
         copynes_get_status(cn);
         cn->status &= ~TIOCM_DTR;
         copynes_set_status(cn);
-        usleep(USLEEP_SHORT);
+        TRACE3(reset, cn, mode, TRACE_RESET_LOW);
+        if(copynes_sleep(cn, USLEEP_SHORT) < 0)
+            return -cn->err;
     }
     
     /* pull /RESET high       set D2
@@ -204,13 +326,18 @@ int copynes_reset(copynes_t cn, int mode)
     copynes_get_status(cn);
     cn->status |= TIOCM_DTR;
     copynes_set_status(cn);
+    TRACE3(reset, cn, mode, TRACE_RESET_HIGH);
     
     /* stabalize */
-    usleep(USLEEP_SHORT);
+    if(copynes_sleep(cn, USLEEP_SHORT) < 0)
+        return -cn->err;
     copynes_get_status(cn);
     copynes_flush(cn);
-    usleep(USLEEP_SHORT);
+    TRACE3(reset, cn, mode, TRACE_RESET_FLUSH);
+    if(copynes_sleep(cn, USLEEP_SHORT) < 0)
+        return -cn->err;
     
+    TRACE3(reset, cn, mode, TRACE_RESET_DONE);
     return 0;
 }
 
@@ -221,15 +348,43 @@ void copynes_flush(copynes_t cn)
     /* flush I/O buffers on both serial devices */
     tcflush(cn->data, TCIOFLUSH);
     tcflush(cn->control, TCIOFLUSH);
+    
+    /* anything the io_uring or the reader thread already read is stale now too */
+#ifdef COPYNES_HAVE_IO_URING
+    if(cn->engine == IO_ENGINE_URING)
+        copynes_uring_flush(cn);
+#endif
+#if !defined COPYNES_NO_HEAP
+    if(cn->reader.running)
+        copynes_reader_flush(cn);
+#endif
 }
 
 
 /* read data from the CopyNES */
 ssize_t copynes_read(copynes_t cn, void* buf, size_t count, struct timeval *timeout)
+{
+	uint64_t start = 0;
+	ssize_t ret = 0;
+	
+	TRACE2(read_start, cn, count);
+	if(TRACE_ACTIVE(read))
+		start = copynes_trace_clock();
+	
+	ret = copynes_read_data(cn, buf, count, timeout);
+	
+	TRACE4(read, cn, count, ret, TRACE_ACTIVE(read) ? copynes_trace_clock() - start : 0);
+	
+	return ret;
+}
+
+
+static ssize_t copynes_read_data(copynes_t cn, void* buf, size_t count, struct timeval *timeout)
 {
 	ssize_t ret = 0;
 	unsigned int i = 0;
 	int bytes = 0;
+	int nfds = 0;
 	
 	if((count <= 0) || (buf == 0))
 	{
@@ -237,6 +392,16 @@ ssize_t copynes_read(copynes_t cn, void* buf, size_t count, struct timeval *time
 		return -cn->err;
 	}
 	
+#if !defined COPYNES_NO_HEAP
+	if(cn->reader.running)
+		return copynes_reader_read(cn, buf, count, timeout);
+#endif
+	
+#ifdef COPYNES_HAVE_IO_URING
+	if(cn->engine == IO_ENGINE_URING)
+		return copynes_uring_read(cn, buf, count, timeout);
+#endif
+	
 	/* try to read as much data as was requested */
 	while(i < count)
 	{
@@ -251,17 +416,39 @@ ssize_t copynes_read(copynes_t cn, void* buf, size_t count, struct timeval *time
 		/* add the file descriptors to the test sets */
 		FD_SET(cn->data, &cn->readfds);
 		FD_SET(cn->data, &cn->exceptfds);
+		nfds = cn->data;
+		
+		/* wake up if someone cancels us */
+		if(cn->cancel != 0)
+		{
+			FD_SET(cn->cancel->rfd, &cn->readfds);
+			if(cn->cancel->rfd > nfds)
+				nfds = cn->cancel->rfd;
+		}
 		
 		/* wait for input */
-		if((ret = select(cn->data + 1, &cn->readfds, 0, &cn->exceptfds, timeout)) < 0)
+		if((ret = select(nfds + 1, &cn->readfds, 0, &cn->exceptfds, timeout)) < 0)
 		{
+			if(errno == EINTR)
+				continue;
 			cn->err = FAILED_DATA_READ;
 			return -cn->err;
 		}
 		
+		if((ret > 0) && (cn->cancel != 0) && FD_ISSET(cn->cancel->rfd, &cn->readfds))
+		{
+			cn->err = FAILED_CANCELLED;
+			return -cn->err;
+		}
+		
 		/* we've got data ready to read */
 		if((ret > 0) && FD_ISSET(cn->data, &cn->readfds))
 		{
+			/* in batch mode let more of the request pile up first */
+			if((cn->read_mode == READ_MODE_BATCH) &&
+			   (copynes_batch_wait(cn, (count - i), timeout) < 0))
+				return -cn->err;
+			
 			if((bytes = read(cn->data, (buf + i), (count - i))) < 0)
 			{
 				cn->err = FAILED_DATA_READ;
@@ -275,8 +462,86 @@ ssize_t copynes_read(copynes_t cn, void* buf, size_t count, struct timeval *time
 	return (ssize_t)i;
 }
 
+/* select how copynes_read waits for data */
+int copynes_set_read_mode(copynes_t cn, int mode)
+{
+	if((mode != READ_MODE_POLL) && (mode != READ_MODE_BATCH))
+	{
+		cn->err = FAILED_INVALID_PARAMS;
+		return -cn->err;
+	}
+	
+	/* the data channel stays non-blocking either way, so writes can't get
+	   stuck behind flow control where a cancel doesn't reach them */
+	cn->read_mode = mode;
+	
+	return 0;
+}
+
+#if !defined COPYNES_NO_HEAP
+/* start or stop the background reader thread */
+int copynes_set_reader(copynes_t cn, size_t ring_size)
+{
+	/* the io_uring engine already keeps reads queued */
+	if(cn->engine != IO_ENGINE_SELECT)
+	{
+		cn->err = FAILED_INVALID_PARAMS;
+		return -cn->err;
+	}
+	
+	copynes_reader_stop(cn);
+	
+	if(ring_size == 0)
+		return 0;
+	
+	if(copynes_reader_start(cn, 0, ring_size) < 0)
+	{
+		cn->err = FAILED_NO_MEMORY;
+		return -cn->err;
+	}
+	
+	return 0;
+}
+
+/* start the background reader thread on a caller buffer */
+int copynes_set_reader_buf(copynes_t cn, void* buf, size_t size)
+{
+	if((cn->engine != IO_ENGINE_SELECT) || (buf == 0))
+	{
+		cn->err = FAILED_INVALID_PARAMS;
+		return -cn->err;
+	}
+	
+	copynes_reader_stop(cn);
+	
+	if(copynes_reader_start(cn, buf, size) < 0)
+	{
+		cn->err = FAILED_INVALID_PARAMS;
+		return -cn->err;
+	}
+	
+	return 0;
+}
+#endif
+
 /* write data to the CopyNES */
 ssize_t copynes_write(copynes_t cn, void* buf, size_t size)
+{
+	uint64_t start = 0;
+	ssize_t ret = 0;
+	
+	if(TRACE_ACTIVE(write))
+		start = copynes_trace_clock();
+	
+	ret = copynes_write_data(cn, buf, size);
+	
+	TRACE4(write, cn, size, ret, TRACE_ACTIVE(write) ? copynes_trace_clock() - start : 0);
+	
+	return ret;
+}
+
+
+static ssize_t copynes_write_data(copynes_t cn, void* buf, size_t size)
 {
 	ssize_t ret = 0;
 	
@@ -286,6 +551,11 @@ ssize_t copynes_write(copynes_t cn, void* buf, size_t size)
 		return -cn->err;
 	}
 	
+#ifdef COPYNES_HAVE_IO_URING
+	if(cn->engine == IO_ENGINE_URING)
+		return copynes_uring_write(cn, buf, size);
+#endif
+	
 	if((ret = write(cn->data, buf, size)) < 0)
 	{
 		cn->err = FAILED_DATA_WRITE;
@@ -337,6 +607,9 @@ copynes_set_uservars(copynes_t cn, uint8_t enabled[4], uint8_t value[4])
 {
 	int i = 0;
 	for (i = 0; i < 4; i++) {
+		/* the plugin may send something else now */
+		if ((cn->uservar_enabled[i] != enabled[i]) || (cn->uservar_value[i] != value[i]))
+			cn->plugin_last = PACKET_EOD;
 		cn->uservar_enabled[i] = enabled[i];
 		cn->uservar_value[i] = value[i];
 	}
@@ -373,53 +646,123 @@ copynes_apply_uservars(copynes_t cn, uint8_t* prg, long prg_size)
 /* load a specified CopyNES plugin, NOTE: plugin must be full path to the .bin */
 int copynes_load_plugin(copynes_t cn, const char* plugin)
 {
-	FILE* f = 0;
-	uint8_t* prg = 0;
+	return copynes_load_plugin_traced(cn, plugin, 0, 0);
+}
 
-	/* try to open the plugin file */
-	if((f = fopen(plugin, "rb")) == 0)
+
+/* load a plugin from a copy of its .bin file */
+int copynes_load_plugin_image(copynes_t cn, const void* image, size_t size)
+{
+	if((image == 0) || (size <= PLUGIN_PRG_OFFSET))
 	{
-		cn->err = FAILED_PLUGIN_OPEN;
+		cn->err = FAILED_INVALID_PARAMS;
 		return -cn->err;
 	}
 	
+	return copynes_load_plugin_traced(cn, 0, image, size);
+}
+
+
+static int copynes_load_plugin_traced(copynes_t cn, const char* plugin, const void* image, size_t size)
+{
+	uint64_t start = 0;
+	int ret = 0;
+	
+	if(TRACE_ACTIVE(plugin_load))
+		start = copynes_trace_clock();
+	
+	ret = copynes_load_plugin_data(cn, plugin, image, size);
+	
+	TRACE4(plugin_load, cn, plugin, ret, TRACE_ACTIVE(plugin_load) ? copynes_trace_clock() - start : 0);
+	
+	return ret;
+}
+
+
+/* send a plugin from the file at plugin, from image or, with neither, the
+   one sent last time again */
+static int copynes_load_plugin_data(copynes_t cn, const char* plugin, const void* image, size_t size)
+{
+	int fd = -1;
+	uint8_t prg[KB(1)];
+	ssize_t ret = 0;
+
+	if(plugin != 0)
+	{
+		/* try to open the plugin file */
+		if((fd = open(plugin, O_RDONLY)) < 0)
+		{
+			cn->err = FAILED_PLUGIN_OPEN;
+			return -cn->err;
+		}
+		
+		/* read in the plugin prg data */
+		memset(prg, 0, sizeof(prg));
+		ret = pread(fd, prg, KB(1), PLUGIN_PRG_OFFSET);
+		(void)ret;
+		close(fd);
+	}
+	else if(image != 0)
+	{
+		size -= PLUGIN_PRG_OFFSET;
+		memset(prg, 0, sizeof(prg));
+		memcpy(prg, (const uint8_t*)image + PLUGIN_PRG_OFFSET, (size < KB(1)) ? size : KB(1));
+	}
 	
-	/* seek to the plugin prg data */
-	fseek(f, 128, SEEK_SET);
-	prg = calloc(KB(1), sizeof(uint8_t));
+	/* forget what the last plugin used to send */
+	if(((plugin != 0) || (image != 0)) && (memcmp(prg, cn->plugin, KB(1)) != 0))
+	{
+		memcpy(cn->plugin, prg, KB(1));
+		cn->plugin_last = PACKET_EOD;
+	}
 	
-	/* read in the plugin prg data */	
-	fread(prg, KB(1), sizeof(uint8_t), f);
+	/* the copy in the handle is kept as is for reloading after a reset */
+	memcpy(prg, cn->plugin, KB(1));
 	copynes_apply_uservars(cn, prg, KB(1));
 
+#ifdef COPYNES_HAVE_IO_URING
+	/* queue the command and the plugin and submit them together */
+	if(cn->engine == IO_ENGINE_URING)
+		copynes_uring_begin_batch(cn);
+#endif
+
 	/* send the command to store the plugin prg data at 0400h */
-	if(copynes_write(cn, CMD_LOAD_PLUGIN, CMD_SIZE(CMD_LOAD_PLUGIN)) != CMD_SIZE(CMD_LOAD_PLUGIN))
+	if((ret = copynes_write(cn, CMD_LOAD_PLUGIN, CMD_SIZE(CMD_LOAD_PLUGIN))) != CMD_SIZE(CMD_LOAD_PLUGIN))
 	{
-		fclose(f);
-		cn->err = FAILED_COMMAND_SEND;
+#ifdef COPYNES_HAVE_IO_URING
+		if(cn->engine == IO_ENGINE_URING)
+			copynes_uring_end_batch(cn);
+#endif
+		/* a cancel keeps its own error */
+		if(ret != -FAILED_CANCELLED)
+			cn->err = FAILED_COMMAND_SEND;
 		return -cn->err;
 	}
 
 	/* send the data to the CopyNES */
-	if(copynes_write(cn, prg, KB(1)) != KB(1))
+	if((ret = copynes_write(cn, prg, KB(1))) != KB(1))
 	{
-		free(prg);
-		fclose(f);
-		cn->err = FAILED_BLOCK_SEND;
+#ifdef COPYNES_HAVE_IO_URING
+		if(cn->engine == IO_ENGINE_URING)
+			copynes_uring_end_batch(cn);
+#endif
+		if(ret != -FAILED_CANCELLED)
+			cn->err = FAILED_BLOCK_SEND;
 		return -cn->err;
 	}
 	
-	/* cleanup */
-	fclose(f);
-	free(prg);
+#ifdef COPYNES_HAVE_IO_URING
+	if((cn->engine == IO_ENGINE_URING) && ((ret = copynes_uring_end_batch(cn)) < 0))
+	{
+		if(ret != -FAILED_CANCELLED)
+			cn->err = FAILED_BLOCK_SEND;
+		return -cn->err;
+	}
+#endif
 	
-	/* remember which plugin we're running */
-	if(cn->current_plugin != 0)
-		free(cn->current_plugin);
-	cn->current_plugin = strdup(plugin);
-
 	/* wait a bit */
-	usleep(USLEEP_SHORT);
+	if(copynes_sleep(cn, USLEEP_SHORT) < 0)
+		return -cn->err;
 	
 	return 0;
 }
@@ -432,13 +775,16 @@ int copynes_run_plugin(copynes_t cn)
 	if(copynes_write(cn, CMD_RUN_PLUGIN, CMD_SIZE(CMD_RUN_PLUGIN)) != CMD_SIZE(CMD_RUN_PLUGIN))
 	{
 		cn->err = FAILED_COMMAND_SEND;
+		TRACE2(plugin_run, cn, -cn->err);
 		return -cn->err;
 	}
 	
 	/* initialize the reset counters */
 	cn->rbyte = 0;
 	cn->rcount = 0;
+	cn->run_last = PACKET_EOD;
 	
+	TRACE2(plugin_run, cn, 0);
 	return 0;
 }
 
@@ -454,15 +800,73 @@ int copynes_run_plugin(copynes_t cn)
 #define PACKET_READ_RBYTE_2	7
 #define PACKET_END			8
 
+#if !defined COPYNES_NO_HEAP
+/* default packet data allocator */
+static uint8_t* copynes_packet_alloc(void* ctx, int type, int size)
+{
+	(void)ctx;
+	(void)type;
+
+	return calloc(size, sizeof(uint8_t));
+}
+
+
 ssize_t copynes_read_packet(copynes_t cn, copynes_packet_t *p, struct timeval timeout)
 {
+	/* allocate the packet struct */
+	*p = calloc(1, sizeof(struct copynes_packet_s));
+	
+	return copynes_read_packet_into(cn, *p, timeout, copynes_packet_alloc, 0, 0);
+}
+#endif
+
+/* a caller buffer for copynes_read_packet_buf */
+struct copynes_packet_buf_s
+{
+	uint8_t* buf;
+	size_t size;
+};
+
+static uint8_t* copynes_packet_buf(void* ctx, int type, int size)
+{
+	struct copynes_packet_buf_s* b = (struct copynes_packet_buf_s*)ctx;
+
+	(void)type;
+
+	return ((size_t)size <= b->size) ? b->buf : 0;
+}
+
+
+ssize_t copynes_read_packet_buf(copynes_t cn, copynes_packet_t pkt, void* buf, size_t size, struct timeval timeout)
+{
+	struct copynes_packet_buf_s b = { (uint8_t*)buf, size };
+	
+	if((pkt == 0) || (buf == 0))
+	{
+		cn->err = FAILED_INVALID_PARAMS;
+		return -cn->err;
+	}
+	
+	memset(pkt, 0, sizeof(struct copynes_packet_s));
+	
+	return copynes_read_packet_into(cn, pkt, timeout, copynes_packet_buf, 0, &b);
+}
+
+
+/* read a packet into pkt, getting the data buffer from alloc */
+ssize_t copynes_read_packet_into(copynes_t cn, copynes_packet_t pkt, struct timeval timeout, copynes_alloc_fn alloc, copynes_block_fn block, void* ctx)
+{
+	ssize_t ret = 0;
 	int bytes = 0;
 	int i = 0;
 	int j = 0;
+	int n = 0;
+	int mirror = 0;
+	int stop = 0;
 	int state = PACKET_START;
+	int last = -1;
 	uint8_t tmpbyte = 0;
 	uint16_t tmpshort = 0;
-	copynes_packet_t pkt = 0;
 	struct timeval t;
 	
 	t.tv_sec = timeout.tv_sec;
@@ -470,13 +874,31 @@ ssize_t copynes_read_packet(copynes_t cn, copynes_packet_t *p, struct timeval ti
 	
 	while(state != PACKET_END)
 	{
+		/* a new packet comes from -1 */
+		if(state != last)
+		{
+			TRACE4(packet_state, cn, last, state, i);
+			last = state;
+		}
+		
 		switch(state)
 		{
 			case PACKET_START:
 			{
-				/* allocate the packet struct */
-				*p = calloc(1, sizeof(struct copynes_packet_s));
-				pkt = *p;
+				if(pkt == 0)
+				{
+					cn->err = FAILED_NO_MEMORY;
+					return -cn->err;
+				}
+				
+				/* the plugin was stopped early, finish the dump */
+				if(cn->stopped)
+				{
+					cn->stopped = 0;
+					pkt->type = PACKET_EOD;
+					state = PACKET_END;
+					break;
+				}
 				
 				/* move to the next state */
 				state = PACKET_READ_SIZE_1;
@@ -490,9 +912,11 @@ ssize_t copynes_read_packet(copynes_t cn, copynes_packet_t *p, struct timeval ti
 				t.tv_sec = timeout.tv_sec;
 				t.tv_usec = timeout.tv_usec;
 				/* read in the least significant byte */
-				if(copynes_read(cn, &((uint8_t*)&tmpshort)[1], sizeof(uint8_t), &t) != sizeof(uint8_t))
+				if((ret = copynes_read(cn, &((uint8_t*)&tmpshort)[1], sizeof(uint8_t), &t)) != sizeof(uint8_t))
 				{
-					cn->err = FAILED_DATA_READ;
+					/* a cancel keeps its own error */
+					if(ret != -FAILED_CANCELLED)
+						cn->err = FAILED_DATA_READ;
 					return -cn->err;
 				}
 				
@@ -509,9 +933,11 @@ ssize_t copynes_read_packet(copynes_t cn, copynes_packet_t *p, struct timeval ti
 				t.tv_usec = timeout.tv_usec;
 
 				/* read in the most significant byte */
-				if(copynes_read(cn, &((uint8_t*)&tmpshort)[0], sizeof(uint8_t), &t) != sizeof(uint8_t))
+				if((ret = copynes_read(cn, &((uint8_t*)&tmpshort)[0], sizeof(uint8_t), &t)) != sizeof(uint8_t))
 				{
-					cn->err = FAILED_DATA_READ;
+					/* a cancel keeps its own error */
+					if(ret != -FAILED_CANCELLED)
+						cn->err = FAILED_DATA_READ;
 					return -cn->err;
 				}
 				
@@ -534,9 +960,11 @@ ssize_t copynes_read_packet(copynes_t cn, copynes_packet_t *p, struct timeval ti
 				t.tv_usec = timeout.tv_usec;
 				
 				/* read in the packet format */
-				if(copynes_read(cn, &tmpbyte, sizeof(uint8_t), &t) != sizeof(uint8_t))
+				if((ret = copynes_read(cn, &tmpbyte, sizeof(uint8_t), &t)) != sizeof(uint8_t))
 				{
-					cn->err = FAILED_DATA_READ;
+					/* a cancel keeps its own error */
+					if(ret != -FAILED_CANCELLED)
+						cn->err = FAILED_DATA_READ;
 					return -cn->err;
 				}
 				
@@ -553,7 +981,11 @@ ssize_t copynes_read_packet(copynes_t cn, copynes_packet_t *p, struct timeval ti
 						if(pkt->size > 0)
 						{
 							/* allocate a buffer for the data */
-							pkt->data = calloc(pkt->size, sizeof(uint8_t));
+							if((pkt->data = alloc(ctx, pkt->type, pkt->size)) == 0)
+							{
+								cn->err = FAILED_NO_MEMORY;
+								return -cn->err;
+							}
 				
 							/* move to the next state */
 							state = PACKET_READ_DATA;
@@ -561,6 +993,12 @@ ssize_t copynes_read_packet(copynes_t cn, copynes_packet_t *p, struct timeval ti
 							/* set up the indexes */
 							i = 0;
 							j = 0;
+							
+							/* WRAM is RAM contents, mirrors only mean something for ROM */
+							if(cn->mirror_mode && (pkt->type != PACKET_WRAM))
+								mirror = (pkt->type == PACKET_PRG_ROM) ? MIRROR_MIN_PRG : MIRROR_MIN_CHR;
+							
+							cn->run_last = pkt->type;
 						}
 						else
 						{
@@ -579,6 +1017,10 @@ ssize_t copynes_read_packet(copynes_t cn, copynes_packet_t *p, struct timeval ti
 					}
 					case PACKET_EOD:
 					{
+						/* the plugin ran to the end, now we know what it sends last */
+						if(pkt->type == PACKET_EOD)
+							cn->plugin_last = cn->run_last;
+						
 						/* move to the end state */
 						state = PACKET_END;
 						
@@ -601,15 +1043,21 @@ ssize_t copynes_read_packet(copynes_t cn, copynes_packet_t *p, struct timeval ti
 				{
 					if(j < KB(1))
 					{
-						/* read the remaining data up to 1K */
-						bytes = copynes_read(cn, &pkt->data[i + j], (KB(1) - j), &t);
+						/* read the remaining data up to 1K, never past the end of a
+						   shorter packet */
+						n = KB(1) - j;
+						if(n > (pkt->size - i - j))
+							n = pkt->size - i - j;
+						
+						if((bytes = copynes_read(cn, &pkt->data[i + j], n, &t)) < 0)
+							return bytes;
 					
 						/* track how many bytes we've read */
 						j += bytes;
 					}
 					
-					/* if we've finished reading the 1K of data... */
-					if(j >= KB(1))
+					/* if we've finished reading the 1K of data or the packet... */
+					if((j >= KB(1)) || ((i + j) >= pkt->size))
 					{
 						/* update total of how much we've read */
 						i += j;
@@ -617,6 +1065,45 @@ ssize_t copynes_read_packet(copynes_t cn, copynes_packet_t *p, struct timeval ti
 						/* reset 1K counter */
 						j = 0;
 						
+						/* see if the data has started repeating itself, a
+						   short last block can't say much */
+						if((mirror > 0) && ((i & (KB(1) - 1)) == 0))
+						{
+							mirror = copynes_mirror_check(pkt->data, i, mirror);
+							if(i >= (mirror * 2))
+								pkt->mirror_size = mirror;
+							else
+								pkt->mirror_size = 0;
+							
+							/* certain enough, keep just one copy.  the plugin is
+							   reset, so only the last packet may be cut short:
+							   the caller has to say it is and the plugin must
+							   have shown it in a whole dump before */
+							if((cn->mirror_mode & MIRROR_STOP) && (i < pkt->size) &&
+							   (cn->mirror_mode & MIRROR_LAST_FLAG(pkt->type)) &&
+							   (cn->plugin_last == pkt->type) &&
+							   (i >= (mirror * MIRROR_STOP_COPIES)))
+								stop = mirror;
+						}
+						
+						/* the caller may have seen enough too */
+						if((stop == 0) && (block != 0) && block(ctx, pkt, i))
+							stop = i;
+						
+						/* stop the plugin and trim the packet */
+						if(stop > 0)
+						{
+							if(copynes_reset(cn, RESET_COPYMODE) == -FAILED_CANCELLED)
+								return -cn->err;
+							
+							pkt->size = stop;
+							pkt->blocks = stop >> 8;
+							i = stop;
+							cn->stopped = 1;
+							state = PACKET_END;
+							break;
+						}
+						
 						/* check to see if we need to reset the NES */
 						if(cn->rbyte)
 						{
@@ -640,14 +1127,17 @@ ssize_t copynes_read_packet(copynes_t cn, copynes_packet_t *p, struct timeval ti
 					if(cn->rbyte <= cn->rcount)
 					{
 						/* reset the NES */
-						copynes_reset(cn, RESET_COPYMODE);
+						if(copynes_reset(cn, RESET_COPYMODE) == -FAILED_CANCELLED)
+							return -cn->err;
 
-						/* reload the plugin */
-						copynes_load_plugin (cn, cn->current_plugin);
+						/* reload the plugin, from the copy in the handle */
+						if(copynes_load_plugin_traced(cn, 0, 0, 0) == -FAILED_CANCELLED)
+							return -cn->err;
 
 						/* rerun the plugin. NOTE: this will reset rbyte and rcount */
 						copynes_run_plugin (cn);
-						usleep(USLEEP_LONG);
+						if(copynes_sleep(cn, USLEEP_LONG) < 0)
+							return -cn->err;
 						
 						/* move to the next state */
 						state = PACKET_READ_RBYTE_1;
@@ -672,9 +1162,11 @@ ssize_t copynes_read_packet(copynes_t cn, copynes_packet_t *p, struct timeval ti
 				t.tv_usec = timeout.tv_usec;
 				
 				/* read in the least significant byte */
-				if(copynes_read(cn, &((uint8_t*)&tmpshort)[1], sizeof(uint8_t), &t) != sizeof(uint8_t))
+				if((ret = copynes_read(cn, &((uint8_t*)&tmpshort)[1], sizeof(uint8_t), &t)) != sizeof(uint8_t))
 				{
-					cn->err = FAILED_DATA_READ;
+					/* a cancel keeps its own error */
+					if(ret != -FAILED_CANCELLED)
+						cn->err = FAILED_DATA_READ;
 					return -cn->err;
 				}
 				
@@ -691,9 +1183,11 @@ ssize_t copynes_read_packet(copynes_t cn, copynes_packet_t *p, struct timeval ti
 				t.tv_usec = timeout.tv_usec;
 
 				/* read in the most significant byte */
-				if(copynes_read(cn, &((uint8_t*)&tmpshort)[0], sizeof(uint8_t), &t) != sizeof(uint8_t))
+				if((ret = copynes_read(cn, &((uint8_t*)&tmpshort)[0], sizeof(uint8_t), &t)) != sizeof(uint8_t))
 				{
-					cn->err = FAILED_DATA_READ;
+					/* a cancel keeps its own error */
+					if(ret != -FAILED_CANCELLED)
+						cn->err = FAILED_DATA_READ;
 					return -cn->err;
 				}
 				
@@ -709,9 +1203,203 @@ ssize_t copynes_read_packet(copynes_t cn, copynes_packet_t *p, struct timeval ti
 		}
 	}
 	
+	TRACE4(packet_state, cn, last, state, i);
+	
 	return (ssize_t)i;
 }
 
+/* turn mirror detection on or off */
+int copynes_set_mirror_detect(copynes_t cn, int flags)
+{
+	if(flags & ~(MIRROR_DETECT | MIRROR_STOP | MIRROR_LAST_PRG | MIRROR_LAST_CHR))
+	{
+		cn->err = FAILED_INVALID_PARAMS;
+		return -cn->err;
+	}
+	
+	/* stopping has to know which packet ends the dump */
+	if((flags & MIRROR_STOP) && !(flags & (MIRROR_LAST_PRG | MIRROR_LAST_CHR)))
+	{
+		cn->err = FAILED_INVALID_PARAMS;
+		return -cn->err;
+	}
+	
+	/* stopping needs detecting */
+	if(flags & MIRROR_STOP)
+		flags |= MIRROR_DETECT;
+	
+	cn->mirror_mode = flags;
+	cn->stopped = 0;
+	
+	return 0;
+}
+
+
+/* wakeup fds: an eventfd on linux, a self-pipe everywhere else.  rfd polls
+   readable from the first signal until it is drained */
+int copynes_wakeup_new(int* rfd, int* wfd)
+{
+#if defined __linux__
+	/* one eventfd is both ends */
+	if((*rfd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK)) < 0)
+		return -1;
+	*wfd = *rfd;
+#else
+	int fds[2];
+	
+	if(pipe(fds) < 0)
+		return -1;
+	fcntl(fds[0], F_SETFL, O_NONBLOCK);
+	fcntl(fds[1], F_SETFL, O_NONBLOCK);
+	fcntl(fds[0], F_SETFD, FD_CLOEXEC);
+	fcntl(fds[1], F_SETFD, FD_CLOEXEC);
+	*rfd = fds[0];
+	*wfd = fds[1];
+#endif
+	
+	return 0;
+}
+
+
+void copynes_wakeup_free(int rfd, int wfd)
+{
+	close(rfd);
+	if(wfd != rfd)
+		close(wfd);
+}
+
+
+/* async signal safe */
+void copynes_wakeup_signal(int rfd, int wfd)
+{
+	uint64_t one = 1;
+	ssize_t ret = 0;
+	
+	/* a full pipe/counter is already signalled, nothing to do on EAGAIN */
+	ret = write(wfd, &one, (wfd == rfd) ? sizeof(one) : 1);
+	(void)ret;
+}
+
+
+void copynes_wakeup_drain(int rfd)
+{
+	uint8_t buf[64];
+	
+	while(read(rfd, buf, sizeof(buf)) > 0)
+		;
+}
+
+
+#if defined COPYNES_NO_HEAP
+typedef char copynes_cancel_storage_check[(sizeof(struct copynes_cancel_s) <= sizeof(copynes_cancel_storage_t)) ? 1 : -1];
+
+/* create a cancellation handle in caller storage */
+copynes_cancel_t copynes_cancel_new_static(copynes_cancel_storage_t* storage)
+{
+	copynes_cancel_t c = (copynes_cancel_t)storage;
+	
+	if(copynes_wakeup_new(&c->rfd, &c->wfd) < 0)
+		return 0;
+	
+	return c;
+}
+#else
+/* create a cancellation handle */
+copynes_cancel_t copynes_cancel_new()
+{
+	copynes_cancel_t c = 0;
+	
+	if((c = calloc(1, sizeof(struct copynes_cancel_s))) == 0)
+		return 0;
+	
+	if(copynes_wakeup_new(&c->rfd, &c->wfd) < 0)
+	{
+		free(c);
+		return 0;
+	}
+	
+	return c;
+}
+#endif
+
+
+void copynes_cancel_free(copynes_cancel_t c)
+{
+	if(c == 0)
+		return;
+	
+	copynes_wakeup_free(c->rfd, c->wfd);
+#if !defined COPYNES_NO_HEAP
+	free(c);
+#endif
+}
+
+
+/* cancel every blocking call on the handles using c, safe to call from
+   other threads and from signal handlers */
+void copynes_cancel(copynes_cancel_t c)
+{
+	copynes_wakeup_signal(c->rfd, c->wfd);
+}
+
+
+/* re-arm the handle after a cancel so the handles can be used again */
+void copynes_cancel_clear(copynes_cancel_t c)
+{
+	copynes_wakeup_drain(c->rfd);
+}
+
+
+/* test whether c has been cancelled */
+int copynes_cancelled(copynes_cancel_t c)
+{
+	fd_set readfds;
+	struct timeval t = { 0L, 0L };
+	
+	if(c == 0)
+		return 0;
+	
+	FD_ZERO(&readfds);
+	FD_SET(c->rfd, &readfds);
+	
+	return (select(c->rfd + 1, &readfds, 0, 0, &t) > 0);
+}
+
+
+/* attach a cancellation handle to cn, 0 detaches */
+void copynes_set_cancel(copynes_t cn, copynes_cancel_t c)
+{
+	cn->cancel = c;
+}
+
+
+#ifndef COPYNES_HAVE_IO_URING
+/* without io_uring support there are no rings to hand out */
+copynes_ring_t copynes_ring_new(int max_handles)
+{
+	(void)max_handles;
+
+	return 0;
+}
+
+
+void copynes_ring_free(copynes_ring_t ring)
+{
+	(void)ring;
+}
+#endif
+
+/* monotonic nanoseconds for the trace timings */
+static uint64_t copynes_trace_clock()
+{
+	struct timespec ts;
+	
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	
+	return ((uint64_t)ts.tv_sec * 1000000000ULL) + ts.tv_nsec;
+}
+
+
 /* get the error string associated with the error */
 char* copynes_error_string(copynes_t cn)
 {
@@ -814,6 +1502,140 @@ static void copynes_configure_devices(copynes_t cn)
 	tcsetattr(cn->control, TCSAFLUSH, &controlios);
 }
 
+/* wait up to BATCH_WAIT_USEC for want bytes (at most BATCH_MAX) to be
+   queued on the data channel, taking the time off the caller's timeout.
+   the sleep is a select on the cancel fd so a cancel still ends it */
+static int copynes_batch_wait(copynes_t cn, size_t want, struct timeval* timeout)
+{
+	struct timeval wait;
+	struct timeval left;
+	fd_set fds;
+	int queued = 0;
+	int nfds = 0;
+	int ret = 0;
+	
+	if(want > BATCH_MAX)
+		want = BATCH_MAX;
+	
+	/* already there, or we can't tell */
+	if((ioctl(cn->data, TIOCINQ, &queued) < 0) || (queued >= (int)want))
+		return 0;
+	
+	wait.tv_sec = 0;
+	wait.tv_usec = BATCH_WAIT_USEC;
+	if((timeout != 0) && timercmp(timeout, &wait, <))
+		wait = *timeout;
+	left = wait;
+	
+	FD_ZERO(&fds);
+	if(cn->cancel != 0)
+	{
+		FD_SET(cn->cancel->rfd, &fds);
+		nfds = cn->cancel->rfd + 1;
+	}
+	
+	/* linux leaves the time not slept in left */
+	if((ret = select(nfds, &fds, 0, 0, &left)) < 0)
+	{
+		if(errno != EINTR)
+		{
+			cn->err = FAILED_DATA_READ;
+			return -cn->err;
+		}
+	}
+	else if(ret > 0)
+	{
+		cn->err = FAILED_CANCELLED;
+		return -cn->err;
+	}
+	
+	if(timeout != 0)
+	{
+		timersub(&wait, &left, &wait);
+		timersub(timeout, &wait, timeout);
+	}
+	
+	return 0;
+}
+
+/* test that everything from size up to end repeats the first size bytes,
+   memcmp is vectorized by the C library so compare in as big pieces as we can */
+static int copynes_mirror_verify(const uint8_t* data, int end, int size)
+{
+	int off = 0;
+	int len = 0;
+	
+	for(off = size; off < end; off += size)
+	{
+		len = ((end - off) < size) ? (end - off) : size;
+		if(memcmp(&data[off], data, len) != 0)
+			return 0;
+	}
+	
+	return 1;
+}
+
+
+/* update the mirror size after the 1K block ending at end came in, returns
+   the smallest power of two the data read so far repeats at */
+static int copynes_mirror_check(const uint8_t* data, int end, int size)
+{
+	int off = end - KB(1);
+	
+	/* still filling the first copy */
+	if(off < size)
+		return size;
+	
+	/* the new block has to match the block one mirror size back */
+	if(memcmp(&data[off], &data[off & (size - 1)], KB(1)) == 0)
+		return size;
+	
+	/* it doesn't, find a bigger size that everything so far agrees with */
+	for(size *= 2; size < end; size *= 2)
+	{
+		if(copynes_mirror_verify(data, end, size))
+			break;
+	}
+	
+	return size;
+}
+
+
+/* sleep for usec, waking early and failing if the handle gets cancelled */
+static int copynes_sleep(copynes_t cn, int usec)
+{
+	fd_set readfds;
+	struct timeval t;
+	int ret = 0;
+	
+	if(cn->cancel == 0)
+	{
+		usleep(usec);
+		return 0;
+	}
+	
+	t.tv_sec = usec / 1000000;
+	t.tv_usec = usec % 1000000;
+	
+	do
+	{
+		FD_ZERO(&readfds);
+		FD_SET(cn->cancel->rfd, &readfds);
+		
+		/* on linux select leaves the time remaining in t */
+		ret = select(cn->cancel->rfd + 1, &readfds, 0, 0, &t);
+	}
+	while((ret < 0) && (errno == EINTR));
+	
+	if(ret > 0)
+	{
+		cn->err = FAILED_CANCELLED;
+		return -1;
+	}
+	
+	return 0;
+}
+
 #if 0
 int copynes_dump(copynes_t cn)
 {
@@ -30,6 +30,23 @@
 #define RESET_ALTPORT  			2
 #define RESET_NORESET  			4
 
+/* read modes */
+#define READ_MODE_POLL			0		/* wake on every USB transfer (default) */
+#define READ_MODE_BATCH			1		/* wait a moment for up to 1K per wakeup */
+
+/* blocking calls return -ERROR_CANCELLED after copynes_cancel */
+#define ERROR_CANCELLED			11
+
+/* I/O engines for the data channel */
+#define IO_ENGINE_SELECT		0		/* select + read/write (default) */
+#define IO_ENGINE_URING			1		/* io_uring, Linux only */
+
+/* mirror detection flags */
+#define MIRROR_DETECT			1		/* report repeating PRG/CHR data */
+#define MIRROR_STOP				2		/* reset the CopyNES once a mirror is certain */
+#define MIRROR_LAST_PRG			4		/* the plugin sends nothing after PRG */
+#define MIRROR_LAST_CHR			8		/* the plugin sends nothing after CHR */
+
 /* mirroring values */
 #define MIRRORING_HORIZONTAL	0		/* hard wired */
 #define MIRRORING_VERTICAL		1		/* hard wired */
@@ -44,6 +61,8 @@
 #define PACKET_EOD				0		/* End of data */
 
 typedef struct copynes_s *copynes_t;
+typedef struct copynes_ring_s *copynes_ring_t;
+typedef struct copynes_cancel_s *copynes_cancel_t;
 
 typedef struct copynes_packet_s
 {
@@ -51,15 +70,43 @@ typedef struct copynes_packet_s
 	int size;							/* in bytes */
 	int type;							/* packet type */
 	uint8_t* data;						/* the data */
+	int mirror_size;					/* size the data repeats at, 0 if it doesn't */
 } *copynes_packet_t;
 
+#if defined COPYNES_NO_HEAP
+/* built with COPYNES_NO_HEAP the library never touches the heap: handles
+   live in caller storage and the packet data goes into caller buffers
+   (copynes_read_packet_buf).  paths are limited to COPYNES_PATH_MAX and
+   there is no io_uring engine and no reader thread, creating a thread has
+   libc allocate its stack */
+#define COPYNES_PATH_MAX		256
+#define COPYNES_STORAGE_SIZE	4096
+
+typedef struct { uint8_t opaque[COPYNES_STORAGE_SIZE]; } __attribute__((aligned(64))) copynes_storage_t;
+typedef struct { int opaque[2]; } copynes_cancel_storage_t;
+
+/* set up a handle in storage, copynes_free only closes it */
+copynes_t copynes_new_static(copynes_storage_t* storage);
+#else
 copynes_t copynes_new();
+#endif
 void copynes_free(void* cn);
 
 /* initialize/deinitialize the copy nes device */
 int copynes_open(copynes_t cn, const char* data_device, const char* control_device);
 void copynes_close(copynes_t cn);
 
+/* same as copynes_open but selects the I/O engine for the data channel.  the
+   ring is only used by IO_ENGINE_URING and may be 0, in which case the handle
+   gets a ring of its own */
+int copynes_open_engine(copynes_t cn, const char* data_device, const char* control_device, int engine, copynes_ring_t ring);
+
+/* create an io_uring that up to max_handles CopyNES handles can share.  the
+   handles sharing a ring must all be used from the same thread and the ring
+   must be freed after the last of them is closed */
+copynes_ring_t copynes_ring_new(int max_handles);
+void copynes_ring_free(copynes_ring_t ring);
+
 /* reset the copy nes device into the mode specified */
 int copynes_reset(copynes_t cn, int mode);
 
@@ -69,6 +116,23 @@ void copynes_flush(copynes_t cn);
 /* read data from the CopyNES */
 ssize_t copynes_read(copynes_t cn, void* buf, size_t count, struct timeval *timeout);
 
+/* select how copynes_read waits for data, one of the READ_MODE_* values */
+int copynes_set_read_mode(copynes_t cn, int mode);
+
+/* drain the data channel on a thread of its own into a ring of ring_size
+   bytes (rounded up to a power of two) that copynes_read takes its data
+   from, so the CopyNES is never held off while the caller is busy.  a
+   ring_size of 0 stops the thread.  the read mode doesn't apply while the
+   thread runs and it can't be used with IO_ENGINE_URING */
+#if !defined COPYNES_NO_HEAP
+int copynes_set_reader(copynes_t cn, size_t ring_size);
+
+/* same as copynes_set_reader with a caller buffer as the ring.  the ring is
+   the largest power of two that fits in size, at least 4K.  the buffer must
+   stay around until the thread is stopped or the handle closed */
+int copynes_set_reader_buf(copynes_t cn, void* buf, size_t size);
+#endif
+
 /* write data to the CopyNES */
 ssize_t copynes_write(copynes_t cn, void* buf, size_t size);
 
@@ -81,15 +145,58 @@ ssize_t copynes_get_version(copynes_t cn, void* buf, size_t size);
 /* load a specified CopyNES plugin, NOTE: plugin must be full path to the .bin */
 int copynes_load_plugin(copynes_t cn, const char* plugin);
 
+/* same as copynes_load_plugin from a copy of the .bin file held in memory,
+   so a caller loading the same plugin over and over can keep it around */
+int copynes_load_plugin_image(copynes_t cn, const void* image, size_t size);
+
 /* run the loaded plugin */
 int copynes_run_plugin(copynes_t cn);
 
+#if !defined COPYNES_NO_HEAP
 /* read a standard CopyNES packet */
 ssize_t copynes_read_packet(copynes_t cn, copynes_packet_t *p, struct timeval timeout);
+#endif
+
+/* read a standard CopyNES packet into pkt with the data going into buf, a
+   packet bigger than size fails with "not enough memory" */
+ssize_t copynes_read_packet_buf(copynes_t cn, copynes_packet_t pkt, void* buf, size_t size, struct timeval timeout);
+
+/* look for PRG/CHR data that repeats at a power of two size, at least 16K
+   for PRG and 8K for CHR.  with MIRROR_DETECT the packet's mirror_size is
+   set once at least two copies came in.  MIRROR_STOP also resets the
+   CopyNES as soon as four copies came in, trims the packet to the mirror
+   size and ends the dump: the next copynes_read_packet returns PACKET_EOD.
+   everything the plugin would have sent afterwards is lost, so MIRROR_STOP
+   only stops packets whose type is marked as the last one of the dump with
+   MIRROR_LAST_PRG/MIRROR_LAST_CHR and is refused without either.  e.g. PRG
+   then CHR carts want MIRROR_LAST_CHR, carts with CHR RAM MIRROR_LAST_PRG.
+   on top of that the loaded plugin has to have ended with a packet of that
+   type in a whole dump before, so the first dump with a plugin (or after
+   changing its uservars) always runs to the end, and a wrong flag never
+   gets to cut anything; copynes_cart_read fails on it instead */
+int copynes_set_mirror_detect(copynes_t cn, int flags);
 
 /* get the error string associated with the error */
 char* copynes_error_string(copynes_t cn);
 
+/* cancellation handles.  once copynes_cancel is called every blocking call on
+   the handles using c returns -ERROR_CANCELLED promptly,
+   and keeps doing so until copynes_cancel_clear.  copynes_cancel may be called
+   from any thread or a signal handler.  a cancelled dump leaves the CopyNES
+   mid-transfer, reset it before starting over */
+#if defined COPYNES_NO_HEAP
+copynes_cancel_t copynes_cancel_new_static(copynes_cancel_storage_t* storage);
+#else
+copynes_cancel_t copynes_cancel_new();
+#endif
+void copynes_cancel_free(copynes_cancel_t c);
+void copynes_cancel(copynes_cancel_t c);
+void copynes_cancel_clear(copynes_cancel_t c);
+int copynes_cancelled(copynes_cancel_t c);
+
+/* attach a cancellation handle to cn, 0 detaches it */
+void copynes_set_cancel(copynes_t cn, copynes_cancel_t c);
+
 /* set plugin specific uservars */
 int copynes_set_uservars(copynes_t cn, uint8_t enabled[4], uint8_t value[4]);
 #endif
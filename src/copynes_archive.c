@@ -0,0 +1,742 @@
+/* -*- Mode: C; indent-tabs-mode: t; c-basic-offset: 4; tab-width: 4 -*- */
+/*
+ * copynes_archive.c
+ * Copyright (C) David Huseby 2009 <dave@linuxprogrammer.org>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with main.c; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor Boston, MA 02110-1301,  USA
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <termios.h>
+#include <pthread.h>
+#include <arpa/inet.h>
+#include <sys/time.h>
+#include <sys/types.h>
+#include <sys/select.h>
+
+#if defined COPYNES_HAVE_ZSTD
+#include <zstd.h>
+#elif defined COPYNES_HAVE_ZLIB
+#include <zlib.h>
+#endif
+
+#include "copynes.h"
+#include "copynes_private.h"
+#include "copynes_archive.h"
+
+#define ARCHIVE_MAX_THREADS		16
+#define ARCHIVE_DEFAULT_THREADS	2
+#define ARCHIVE_HDR_SIZE		11
+
+/* a block waiting to be compressed or written */
+struct archive_block_s
+{
+	int type;
+	int flags;
+	int codec;
+	int done;
+	uint32_t raw_size;
+	uint32_t stored_size;
+	uint8_t* raw;
+	uint8_t* stored;
+	struct archive_block_s* next;		/* in file order */
+	struct archive_block_s* next_job;	/* in the work queue */
+};
+
+struct copynes_archive_s
+{
+	FILE* f;
+	int reading;						/* opened by copynes_archive_open */
+	int mirroring;
+	int next;							/* type of the next block, -1 at the end */
+	int next_flags;
+	int err;
+	int quit;
+	int nthreads;
+	pthread_t threads[ARCHIVE_MAX_THREADS];
+	pthread_mutex_t lock;
+	pthread_cond_t work;				/* a job was queued */
+	pthread_cond_t done;				/* a job was finished */
+	struct archive_block_s* head;		/* oldest block not yet written */
+	struct archive_block_s* tail;
+	struct archive_block_s* jobs;		/* blocks not yet picked up */
+	struct archive_block_s* jobs_tail;
+};
+
+/* block hook state for one copynes_archive_read packet */
+struct archive_feed_s
+{
+	copynes_archive_t ar;
+	int queued;							/* bytes of the packet already queued */
+	int err;
+};
+
+
+int copynes_archive_codec()
+{
+#if defined COPYNES_HAVE_ZSTD
+	return ARCHIVE_CODEC_ZSTD;
+#elif defined COPYNES_HAVE_ZLIB
+	return ARCHIVE_CODEC_ZLIB;
+#else
+	return ARCHIVE_CODEC_PACKBITS;
+#endif
+}
+
+
+/* worst case size of a compressed block */
+static size_t archive_bound(size_t size)
+{
+#if defined COPYNES_HAVE_ZSTD
+	return ZSTD_compressBound(size);
+#elif defined COPYNES_HAVE_ZLIB
+	return compressBound(size);
+#else
+	/* packbits adds one byte per 128 literals */
+	return size + (size / 128) + 1;
+#endif
+}
+
+
+#if !defined COPYNES_HAVE_ZSTD && !defined COPYNES_HAVE_ZLIB
+/* PackBits: a control byte n in 0..127 is followed by n + 1 literals, n in
+   129..255 means repeat the next byte 257 - n times.  ROM and WRAM images
+   are full of 0x00/0xff fill so even this does well on them */
+static size_t archive_packbits(const uint8_t* in, size_t size, uint8_t* out)
+{
+	size_t i = 0;
+	size_t o = 0;
+	size_t run = 0;
+	size_t lit = 0;
+
+	while(i < size)
+	{
+		/* measure the run starting here */
+		run = 1;
+		while(((i + run) < size) && (run < 128) && (in[i + run] == in[i]))
+			run++;
+
+		if(run >= 3)
+		{
+			out[o++] = (uint8_t)(257 - run);
+			out[o++] = in[i];
+			i += run;
+			continue;
+		}
+
+		/* gather literals up to the next run of three */
+		lit = 0;
+		while(((i + lit) < size) && (lit < 128))
+		{
+			if(((i + lit + 2) < size) && (in[i + lit] == in[i + lit + 1]) && (in[i + lit] == in[i + lit + 2]))
+				break;
+			lit++;
+		}
+
+		out[o++] = (uint8_t)(lit - 1);
+		memcpy(&out[o], &in[i], lit);
+		o += lit;
+		i += lit;
+	}
+
+	return o;
+}
+#endif
+
+
+/* compress a block, falling back to storing it if that doesn't help */
+static void archive_compress(struct archive_block_s* b)
+{
+	size_t bound = archive_bound(b->raw_size);
+	size_t size = 0;
+
+	if((b->stored = malloc(bound)) != 0)
+	{
+#if defined COPYNES_HAVE_ZSTD
+		size = ZSTD_compress(b->stored, bound, b->raw, b->raw_size, 3);
+		if(ZSTD_isError(size))
+			size = 0;
+#elif defined COPYNES_HAVE_ZLIB
+		uLongf zsize = bound;
+		if(compress2(b->stored, &zsize, b->raw, b->raw_size, Z_DEFAULT_COMPRESSION) == Z_OK)
+			size = zsize;
+#else
+		size = archive_packbits(b->raw, b->raw_size, b->stored);
+#endif
+	}
+
+	if((size > 0) && (size < b->raw_size))
+	{
+		b->codec = copynes_archive_codec();
+		b->stored_size = size;
+		free(b->raw);
+	}
+	else
+	{
+		/* incompressible, keep the raw data */
+		free(b->stored);
+		b->codec = ARCHIVE_CODEC_STORE;
+		b->stored = b->raw;
+		b->stored_size = b->raw_size;
+	}
+
+	b->raw = 0;
+}
+
+
+/* undo archive_packbits, returns 0 if the data doesn't fill out exactly */
+static int archive_unpackbits(const uint8_t* in, size_t size, uint8_t* out, size_t out_size)
+{
+	size_t i = 0;
+	size_t o = 0;
+	size_t n = 0;
+
+	while(i < size)
+	{
+		if(in[i] < 128)
+		{
+			n = in[i] + 1;
+			if(((i + 1 + n) > size) || ((o + n) > out_size))
+				return 0;
+			memcpy(&out[o], &in[i + 1], n);
+			i += 1 + n;
+		}
+		else if(in[i] > 128)
+		{
+			n = 257 - in[i];
+			if(((i + 1) >= size) || ((o + n) > out_size))
+				return 0;
+			memset(&out[o], in[i + 1], n);
+			i += 2;
+		}
+		else
+			return 0;
+
+		o += n;
+	}
+
+	return (o == out_size);
+}
+
+
+/* decompress a stored block into out, which holds raw_size bytes */
+static int archive_decompress(int codec, const uint8_t* in, size_t size, uint8_t* out, size_t raw_size)
+{
+	switch(codec)
+	{
+		case ARCHIVE_CODEC_STORE:
+		{
+			if(size != raw_size)
+				return 0;
+			memcpy(out, in, size);
+			return 1;
+		}
+		case ARCHIVE_CODEC_PACKBITS:
+			return archive_unpackbits(in, size, out, raw_size);
+#if defined COPYNES_HAVE_ZSTD
+		case ARCHIVE_CODEC_ZSTD:
+			return (ZSTD_decompress(out, raw_size, in, size) == raw_size);
+#elif defined COPYNES_HAVE_ZLIB
+		case ARCHIVE_CODEC_ZLIB:
+		{
+			uLongf zsize = raw_size;
+			return (uncompress(out, &zsize, in, size) == Z_OK) && (zsize == raw_size);
+		}
+#endif
+	}
+
+	/* a codec this build doesn't have */
+	return 0;
+}
+
+
+static void* archive_worker(void* arg)
+{
+	copynes_archive_t ar = (copynes_archive_t)arg;
+	struct archive_block_s* b = 0;
+
+	pthread_mutex_lock(&ar->lock);
+	while(1)
+	{
+		while((ar->jobs == 0) && !ar->quit)
+			pthread_cond_wait(&ar->work, &ar->lock);
+
+		if(ar->jobs == 0)
+			break;
+
+		/* take the oldest job */
+		b = ar->jobs;
+		ar->jobs = b->next_job;
+		if(ar->jobs == 0)
+			ar->jobs_tail = 0;
+
+		pthread_mutex_unlock(&ar->lock);
+		archive_compress(b);
+		pthread_mutex_lock(&ar->lock);
+
+		b->done = 1;
+		pthread_cond_broadcast(&ar->done);
+	}
+	pthread_mutex_unlock(&ar->lock);
+
+	return 0;
+}
+
+
+/* write out every finished block at the head of the list, called locked */
+static void archive_write_ready(copynes_archive_t ar)
+{
+	struct archive_block_s* b = 0;
+	uint8_t hdr[ARCHIVE_HDR_SIZE];
+	uint32_t tmp = 0;
+
+	while((ar->head != 0) && ar->head->done)
+	{
+		b = ar->head;
+
+		hdr[0] = (uint8_t)b->type;
+		hdr[1] = (uint8_t)b->flags;
+		hdr[2] = (uint8_t)b->codec;
+		tmp = htonl(b->raw_size);
+		memcpy(&hdr[3], &tmp, sizeof(tmp));
+		tmp = htonl(b->stored_size);
+		memcpy(&hdr[7], &tmp, sizeof(tmp));
+
+		if((fwrite(hdr, sizeof(hdr), 1, ar->f) != 1) ||
+		   (fwrite(b->stored, b->stored_size, 1, ar->f) != 1))
+		{
+			ar->err = 1;
+		}
+
+		ar->head = b->next;
+		if(ar->head == 0)
+			ar->tail = 0;
+
+		free(b->stored);
+		free(b);
+	}
+}
+
+
+copynes_archive_t copynes_archive_new(const char* path, int mirroring, int threads)
+{
+	copynes_archive_t ar = 0;
+	uint8_t hdr[6] = { 'C', 'N', 'A', 'R', ARCHIVE_VERSION, 0 };
+	int i = 0;
+
+	if(threads <= 0)
+		threads = ARCHIVE_DEFAULT_THREADS;
+	if(threads > ARCHIVE_MAX_THREADS)
+		threads = ARCHIVE_MAX_THREADS;
+
+	if((ar = calloc(1, sizeof(struct copynes_archive_s))) == 0)
+		return 0;
+
+	if((ar->f = fopen(path, "wb")) == 0)
+	{
+		free(ar);
+		return 0;
+	}
+
+	hdr[5] = (uint8_t)mirroring;
+	if(fwrite(hdr, sizeof(hdr), 1, ar->f) != 1)
+	{
+		fclose(ar->f);
+		free(ar);
+		return 0;
+	}
+
+	pthread_mutex_init(&ar->lock, 0);
+	pthread_cond_init(&ar->work, 0);
+	pthread_cond_init(&ar->done, 0);
+
+	/* start the compression threads */
+	for(i = 0; i < threads; i++)
+	{
+		if(pthread_create(&ar->threads[i], 0, archive_worker, ar) != 0)
+			break;
+		ar->nthreads++;
+	}
+
+	if(ar->nthreads == 0)
+	{
+		copynes_archive_close(ar);
+		return 0;
+	}
+
+	return ar;
+}
+
+
+/* copy size bytes of a packet into a new block and queue it, first marks
+   the block a packet starts with */
+static int archive_queue(copynes_archive_t ar, int type, int first, const uint8_t* data, int size)
+{
+	struct archive_block_s* b = 0;
+
+	if(((b = calloc(1, sizeof(struct archive_block_s))) == 0) ||
+	   ((b->raw = malloc(size)) == 0))
+	{
+		free(b);
+		return -1;
+	}
+
+	b->type = type;
+	b->flags = first ? ARCHIVE_BLOCK_FIRST : 0;
+	b->raw_size = size;
+	memcpy(b->raw, data, size);
+
+	pthread_mutex_lock(&ar->lock);
+
+	/* append to the file order list and the work queue */
+	if(ar->tail != 0)
+		ar->tail->next = b;
+	else
+		ar->head = b;
+	ar->tail = b;
+
+	if(ar->jobs_tail != 0)
+		ar->jobs_tail->next_job = b;
+	else
+		ar->jobs = b;
+	ar->jobs_tail = b;
+
+	pthread_cond_signal(&ar->work);
+
+	/* write out whatever earlier blocks have finished meanwhile */
+	archive_write_ready(ar);
+
+	pthread_mutex_unlock(&ar->lock);
+
+	return 0;
+}
+
+
+/* only the data packets belong in the archive */
+static int archive_data_packet(int type)
+{
+	return (type == PACKET_PRG_ROM) || (type == PACKET_CHR_ROM) || (type == PACKET_WRAM);
+}
+
+
+int copynes_archive_add_packet(copynes_archive_t ar, copynes_packet_t pkt)
+{
+	int off = 0;
+	int size = 0;
+
+	if((ar == 0) || ar->reading || (pkt == 0) || (pkt->size < 0) || ((pkt->size > 0) && (pkt->data == 0)))
+		return -1;
+
+	if(!archive_data_packet(pkt->type))
+		return 0;
+
+	for(off = 0; off < pkt->size; off += ARCHIVE_BLOCK_SIZE)
+	{
+		size = ((pkt->size - off) > ARCHIVE_BLOCK_SIZE) ? ARCHIVE_BLOCK_SIZE : (pkt->size - off);
+		if(archive_queue(ar, pkt->type, (off == 0), &pkt->data[off], size) < 0)
+			return -1;
+	}
+
+	return 0;
+}
+
+
+static uint8_t* archive_feed_alloc(void* ctx, int type, int size)
+{
+	struct archive_feed_s* feed = (struct archive_feed_s*)ctx;
+
+	(void)type;
+
+	/* a new packet is starting */
+	feed->queued = 0;
+
+	return malloc(size);
+}
+
+
+/* copynes_read_packet_into block hook, queues every full block right away */
+static int archive_feed_block(void* ctx, copynes_packet_t pkt, int received)
+{
+	struct archive_feed_s* feed = (struct archive_feed_s*)ctx;
+
+	if(!archive_data_packet(pkt->type))
+		return 0;
+
+	while((received - feed->queued) >= ARCHIVE_BLOCK_SIZE)
+	{
+		if(archive_queue(feed->ar, pkt->type, (feed->queued == 0), &pkt->data[feed->queued], ARCHIVE_BLOCK_SIZE) < 0)
+		{
+			/* no point in dumping the rest */
+			feed->err = 1;
+			return 1;
+		}
+		feed->queued += ARCHIVE_BLOCK_SIZE;
+	}
+
+	return 0;
+}
+
+
+ssize_t copynes_archive_read(copynes_archive_t ar, copynes_t cn, struct timeval timeout)
+{
+	struct copynes_packet_s pkt;
+	struct archive_feed_s feed;
+	ssize_t ret = 0;
+	ssize_t total = 0;
+
+	if((ar == 0) || (cn == 0))
+		return -FAILED_INVALID_PARAMS;
+
+	/* a stop trims data that has been queued already */
+	if(ar->reading || (cn->mirror_mode & MIRROR_STOP))
+	{
+		cn->err = FAILED_INVALID_PARAMS;
+		return -cn->err;
+	}
+
+	memset(&feed, 0, sizeof(feed));
+	feed.ar = ar;
+
+	while(1)
+	{
+		memset(&pkt, 0, sizeof(pkt));
+
+		ret = copynes_read_packet_into(cn, &pkt, timeout, archive_feed_alloc, archive_feed_block, &feed);
+
+		/* queue what's left after the last full block */
+		if((ret >= 0) && !feed.err && archive_data_packet(pkt.type) && (feed.queued < pkt.size))
+		{
+			if(archive_queue(ar, pkt.type, (feed.queued == 0), &pkt.data[feed.queued], pkt.size - feed.queued) < 0)
+				feed.err = 1;
+		}
+		free(pkt.data);
+
+		if(ret < 0)
+			return ret;
+
+		if(feed.err)
+		{
+			cn->err = FAILED_NO_MEMORY;
+			return -cn->err;
+		}
+
+		if(pkt.type == PACKET_EOD)
+			break;
+
+		if(archive_data_packet(pkt.type))
+			total += pkt.size;
+	}
+
+	return total;
+}
+
+
+/* read the type and flags of the next block, -1 at the end marker */
+static void archive_next(copynes_archive_t ar)
+{
+	int c = fgetc(ar->f);
+
+	ar->next = -1;
+	ar->next_flags = 0;
+
+	/* a file cut short is an error, the end marker isn't */
+	if(c == EOF)
+		ar->err = 1;
+	else if(c != PACKET_EOD)
+	{
+		ar->next = c;
+		if((ar->next_flags = fgetc(ar->f)) == EOF)
+			ar->err = 1;
+	}
+}
+
+
+copynes_archive_t copynes_archive_open(const char* path)
+{
+	copynes_archive_t ar = 0;
+	uint8_t hdr[6];
+
+	if((ar = calloc(1, sizeof(struct copynes_archive_s))) == 0)
+		return 0;
+
+	if((ar->f = fopen(path, "rb")) == 0)
+	{
+		free(ar);
+		return 0;
+	}
+
+	if((fread(hdr, sizeof(hdr), 1, ar->f) != 1) ||
+	   (memcmp(hdr, "CNAR", 4) != 0) || (hdr[4] != ARCHIVE_VERSION))
+	{
+		fclose(ar->f);
+		free(ar);
+		return 0;
+	}
+
+	ar->reading = 1;
+	ar->mirroring = hdr[5];
+	archive_next(ar);
+
+	return ar;
+}
+
+
+int copynes_archive_mirroring(copynes_archive_t ar)
+{
+	return ar->mirroring;
+}
+
+
+/* append the next block to pkt, returns 0 if it's broken */
+static int archive_read_block(copynes_archive_t ar, copynes_packet_t pkt)
+{
+	uint8_t hdr[ARCHIVE_HDR_SIZE];
+	uint8_t* stored = 0;
+	uint8_t* data = 0;
+	uint32_t raw_size = 0;
+	uint32_t stored_size = 0;
+	uint32_t tmp = 0;
+	int ok = 0;
+
+	hdr[0] = (uint8_t)ar->next;
+	hdr[1] = (uint8_t)ar->next_flags;
+	if(fread(&hdr[2], ARCHIVE_HDR_SIZE - 2, 1, ar->f) != 1)
+		return 0;
+
+	memcpy(&tmp, &hdr[3], sizeof(tmp));
+	raw_size = ntohl(tmp);
+	memcpy(&tmp, &hdr[7], sizeof(tmp));
+	stored_size = ntohl(tmp);
+
+	/* a block is only compressed if that makes it smaller */
+	if((raw_size > ARCHIVE_BLOCK_SIZE) || (stored_size > raw_size))
+		return 0;
+
+	if(((stored = malloc(stored_size)) != 0) &&
+	   ((data = realloc(pkt->data, pkt->size + raw_size)) != 0))
+	{
+		pkt->data = data;
+		ok = (fread(stored, stored_size, 1, ar->f) == 1) &&
+			 archive_decompress(hdr[2], stored, stored_size, &pkt->data[pkt->size], raw_size);
+	}
+	free(stored);
+
+	if(ok)
+	{
+		pkt->type = hdr[0];
+		pkt->size += raw_size;
+	}
+
+	return ok;
+}
+
+
+ssize_t copynes_archive_read_packet(copynes_archive_t ar, copynes_packet_t *p)
+{
+	copynes_packet_t pkt = 0;
+
+	*p = 0;
+	if((ar == 0) || !ar->reading || ar->err)
+		return -1;
+
+	if((pkt = calloc(1, sizeof(struct copynes_packet_s))) == 0)
+		return -1;
+	*p = pkt;
+
+	/* past the last packet */
+	if(ar->next < 0)
+	{
+		pkt->type = PACKET_EOD;
+		return 0;
+	}
+
+	/* a packet has to start with a first block */
+	if(!(ar->next_flags & ARCHIVE_BLOCK_FIRST))
+	{
+		ar->err = 1;
+		return -1;
+	}
+
+	/* take blocks until the next packet starts */
+	do
+	{
+		if(!archive_read_block(ar, pkt))
+		{
+			ar->err = 1;
+			return -1;
+		}
+		archive_next(ar);
+	}
+	while((ar->next == pkt->type) && !(ar->next_flags & ARCHIVE_BLOCK_FIRST) && !ar->err);
+
+	/* a continuation block of another type is as broken as a short file */
+	if((ar->next >= 0) && !(ar->next_flags & ARCHIVE_BLOCK_FIRST))
+		ar->err = 1;
+
+	pkt->blocks = pkt->size >> 8;
+
+	return ar->err ? -1 : (ssize_t)pkt->size;
+}
+
+
+int copynes_archive_close(copynes_archive_t ar)
+{
+	uint8_t eod = PACKET_EOD;
+	int ret = 0;
+	int i = 0;
+
+	if(ar == 0)
+		return -1;
+
+	/* nothing to finish off for a reader */
+	if(ar->reading)
+	{
+		fclose(ar->f);
+		free(ar);
+		return 0;
+	}
+
+	/* wait for the queue to drain and write the blocks in order */
+	pthread_mutex_lock(&ar->lock);
+	while(ar->head != 0)
+	{
+		archive_write_ready(ar);
+		if((ar->head != 0) && !ar->head->done)
+			pthread_cond_wait(&ar->done, &ar->lock);
+	}
+	ar->quit = 1;
+	pthread_cond_broadcast(&ar->work);
+	pthread_mutex_unlock(&ar->lock);
+
+	for(i = 0; i < ar->nthreads; i++)
+		pthread_join(ar->threads[i], 0);
+
+	if(fwrite(&eod, sizeof(eod), 1, ar->f) != 1)
+		ar->err = 1;
+	if(fclose(ar->f) != 0)
+		ar->err = 1;
+
+	ret = ar->err ? -1 : 0;
+
+	pthread_cond_destroy(&ar->done);
+	pthread_cond_destroy(&ar->work);
+	pthread_mutex_destroy(&ar->lock);
+	free(ar);
+
+	return ret;
+}
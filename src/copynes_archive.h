@@ -0,0 +1,93 @@
+/* -*- Mode: C; indent-tabs-mode: t; c-basic-offset: 4; tab-width: 4 -*- */
+/*
+ * copynes_archive.h
+ * Copyright (C) David Huseby 2009 <dave@linuxprogrammer.org>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with main.c; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor Boston, MA 02110-1301,  USA
+ */
+
+/*
+ * Compressed dump archives.  Packets are cut into 64K blocks as they are
+ * added and the blocks are compressed by a small pool of threads while the
+ * next packet is still coming in over the wire.  copynes_archive_read
+ * queues each block as soon as its last 1K arrived instead of waiting for
+ * the whole packet.
+ *
+ * Archive layout, all integers big endian:
+ *
+ *   "CNAR" version(1) mirroring(1)
+ *   block...
+ *   end marker: type(1) = PACKET_EOD
+ *
+ *   block: type(1) flags(1) codec(1) raw size(4) stored size(4)
+ *          data(stored size)
+ *
+ * A packet is an ARCHIVE_BLOCK_FIRST block followed by the blocks up to the
+ * next one, so back to back packets of the same type stay apart.  Blocks
+ * are only compressed when that makes them smaller, otherwise they are
+ * stored.  Reading a block needs its codec built in; packbits and store
+ * always are.
+ */
+
+#ifndef __LIBCOPYNES_ARCHIVE__
+#define __LIBCOPYNES_ARCHIVE__
+
+#define ARCHIVE_VERSION			2
+#define ARCHIVE_BLOCK_SIZE		65536
+
+/* block flags */
+#define ARCHIVE_BLOCK_FIRST		1		/* a packet starts here */
+
+/* block codecs */
+#define ARCHIVE_CODEC_STORE		0		/* uncompressed */
+#define ARCHIVE_CODEC_PACKBITS	1		/* built in run length coding */
+#define ARCHIVE_CODEC_ZLIB		2
+#define ARCHIVE_CODEC_ZSTD		3
+
+typedef struct copynes_archive_s *copynes_archive_t;
+
+/* create an archive file compressing with the given number of threads, the
+   best codec available at build time is used */
+copynes_archive_t copynes_archive_new(const char* path, int mirroring, int threads);
+
+/* queue a completed packet, the data is copied so the caller may free the
+   packet as soon as this returns */
+int copynes_archive_add_packet(copynes_archive_t ar, copynes_packet_t pkt);
+
+/* read packets from a running plugin until PACKET_EOD, queueing every 64K
+   as it comes in.  returns the number of data bytes read.  MIRROR_STOP
+   can't be used, it trims data that is already queued */
+ssize_t copynes_archive_read(copynes_archive_t ar, copynes_t cn, struct timeval timeout);
+
+/* open an archive for reading, 0 if it isn't one this version can read */
+copynes_archive_t copynes_archive_open(const char* path);
+
+/* the mirroring value the archive was created with */
+int copynes_archive_mirroring(copynes_archive_t ar);
+
+/* read the next packet, allocated like copynes_read_packet does.  returns
+   its size, 0 with a PACKET_EOD packet after the last one or -1 if the
+   archive is broken or uses a codec this build doesn't have */
+ssize_t copynes_archive_read_packet(copynes_archive_t ar, copynes_packet_t *p);
+
+/* wait for the compression to finish, write the end marker and free the
+   archive; returns 0 if every block made it to disk.  archives opened for
+   reading are just closed */
+int copynes_archive_close(copynes_archive_t ar);
+
+/* the codec blocks will be compressed with */
+int copynes_archive_codec();
+
+#endif
@@ -0,0 +1,498 @@
+/* -*- Mode: C; indent-tabs-mode: t; c-basic-offset: 4; tab-width: 4 -*- */
+/*
+ * copynes_cache.c
+ * Copyright (C) David Huseby 2009 <dave@linuxprogrammer.org>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with main.c; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor Boston, MA 02110-1301,  USA
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <limits.h>
+#include <errno.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <termios.h>
+#include <pthread.h>
+#include <arpa/inet.h>
+#include <sys/time.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/select.h>
+
+#include "copynes.h"
+#include "copynes_private.h"
+#include "copynes_cart.h"
+#include "copynes_cache.h"
+
+#define CACHE_MAX_CANDIDATES	8
+#define CACHE_MAX_SECTIONS		2
+#define CACHE_HDR_SIZE			(6 + (CACHE_MAX_SECTIONS * 5))
+
+/* where the dump being read is in the lookup */
+#define CACHE_WAIT_PREFIX		0
+#define CACHE_VERIFY			1
+#define CACHE_DONE				2
+
+struct copynes_cache_s
+{
+	char dir[PATH_MAX];
+	int prefix;
+	int verify;
+};
+
+/* block hook state for one copynes_cache_read */
+struct cache_match_s
+{
+	copynes_cache_t cache;
+	copynes_cart_t cart;				/* PRG packets in a row share a section */
+	copynes_cache_accept_fn accept;
+	void* ctx;
+	int state;
+	int type;							/* the packet the last block was from */
+	int size;
+	int received;
+	int in_prg;							/* inside the first run of PRG packets */
+	size_t prg_base;					/* PRG from the run's earlier packets */
+	size_t verified;					/* PRG compared against the candidates */
+	int ncand;
+	int fds[CACHE_MAX_CANDIDATES];		/* open cached dumps still matching */
+	off_t prg_off[CACHE_MAX_CANDIDATES];
+	uint32_t prg_size[CACHE_MAX_CANDIDATES];
+	char paths[CACHE_MAX_CANDIDATES][PATH_MAX];
+	int hit;							/* the accepted candidate or -1 */
+};
+
+
+static void cache_hex(const uint8_t* hash, char* out)
+{
+	static const char hex[] = "0123456789abcdef";
+	int i = 0;
+
+	for(i = 0; i < SHA256_SIZE; i++)
+	{
+		out[i * 2] = hex[hash[i] >> 4];
+		out[i * 2 + 1] = hex[hash[i] & 0x0f];
+	}
+	out[SHA256_SIZE * 2] = '\0';
+}
+
+
+/* the directory holding the dumps that start with prg, -1 if its path
+   doesn't fit */
+static int cache_prefix_dir(copynes_cache_t cache, const uint8_t* prg, char* path, size_t size)
+{
+	uint8_t hash[SHA256_SIZE];
+	char hex[SHA256_SIZE * 2 + 1];
+	int len = 0;
+
+	copynes_sha256(prg, cache->prefix, hash);
+	cache_hex(hash, hex);
+
+	len = snprintf(path, size, "%s/%dk-%s", cache->dir, cache->prefix / KB(1), hex);
+
+	return ((len < 0) || ((size_t)len >= size)) ? -1 : 0;
+}
+
+
+/* read a cached dump's section table, returns the number of sections */
+static int cache_read_header(int fd, int* types, uint32_t* sizes)
+{
+	uint8_t hdr[CACHE_HDR_SIZE];
+	uint32_t v = 0;
+	int count = 0;
+	int i = 0;
+
+	if((pread(fd, hdr, 6, 0) != 6) ||
+	   (memcmp(hdr, "CNDC", 4) != 0) || (hdr[4] != CACHE_VERSION) ||
+	   ((count = hdr[5]) == 0) || (count > CACHE_MAX_SECTIONS))
+		return -1;
+
+	if(pread(fd, &hdr[6], count * 5, 6) != (count * 5))
+		return -1;
+
+	for(i = 0; i < count; i++)
+	{
+		types[i] = hdr[6 + (i * 5)];
+		memcpy(&v, &hdr[7 + (i * 5)], 4);
+		sizes[i] = ntohl(v);
+	}
+
+	if(types[0] != PACKET_PRG_ROM)
+		return -1;
+
+	return count;
+}
+
+
+static void cache_drop(struct cache_match_s* m, int i)
+{
+	close(m->fds[i]);
+
+	m->ncand--;
+	if(i != m->ncand)
+	{
+		m->fds[i] = m->fds[m->ncand];
+		m->prg_off[i] = m->prg_off[m->ncand];
+		m->prg_size[i] = m->prg_size[m->ncand];
+		memcpy(m->paths[i], m->paths[m->ncand], PATH_MAX);
+	}
+}
+
+
+/* open every cached dump starting with the same prefix and holding at
+   least as much PRG as the packets so far announced */
+static void cache_lookup(struct cache_match_s* m, const uint8_t* prg, size_t total)
+{
+	char dir[PATH_MAX];
+	struct dirent* ent = 0;
+	int types[CACHE_MAX_SECTIONS];
+	uint32_t sizes[CACHE_MAX_SECTIONS];
+	int count = 0;
+	DIR* d = 0;
+
+	if((cache_prefix_dir(m->cache, prg, dir, sizeof(dir)) < 0) ||
+	   ((d = opendir(dir)) == 0))
+		return;
+
+	while(((ent = readdir(d)) != 0) && (m->ncand < CACHE_MAX_CANDIDATES))
+	{
+		if(ent->d_name[0] == '.')
+			continue;
+
+		if(snprintf(m->paths[m->ncand], PATH_MAX, "%s/%s", dir, ent->d_name) >= PATH_MAX)
+			continue;
+		if((m->fds[m->ncand] = open(m->paths[m->ncand], O_RDONLY | O_CLOEXEC)) < 0)
+			continue;
+
+		if(((count = cache_read_header(m->fds[m->ncand], types, sizes)) < 0) ||
+		   (sizes[0] < total))
+		{
+			close(m->fds[m->ncand]);
+			continue;
+		}
+
+		m->prg_off[m->ncand] = 6 + (count * 5);
+		m->prg_size[m->ncand] = sizes[0];
+		m->ncand++;
+	}
+	closedir(d);
+}
+
+
+/* drop the candidates whose PRG differs from prg up to end, or whose PRG
+   size can't be total: smaller than it, or unless exact is 0, bigger */
+static void cache_verify(struct cache_match_s* m, const uint8_t* prg, size_t end, size_t total, int exact)
+{
+	uint8_t block[KB(1)];
+	size_t off = 0;
+	size_t n = 0;
+	int i = 0;
+
+	for(i = 0; i < m->ncand; )
+	{
+		if((m->prg_size[i] < total) || (exact && (m->prg_size[i] != total)))
+		{
+			cache_drop(m, i);
+			continue;
+		}
+
+		for(off = m->verified; off < end; off += n)
+		{
+			n = ((end - off) < KB(1)) ? (end - off) : KB(1);
+			if((pread(m->fds[i], block, n, m->prg_off[i] + off) != (ssize_t)n) ||
+			   (memcmp(block, &prg[off], n) != 0))
+				break;
+		}
+
+		if(off < end)
+			cache_drop(m, i);
+		else
+			i++;
+	}
+
+	m->verified = end;
+}
+
+
+/* hand the first dump still matching to the accept callback, returns 1 if
+   it was taken */
+static int cache_offer(struct cache_match_s* m)
+{
+	m->state = CACHE_DONE;
+
+	if((m->ncand > 0) && (m->accept != 0) && m->accept(m->ctx, m->paths[0]))
+	{
+		m->hit = 0;
+		return 1;
+	}
+
+	return 0;
+}
+
+
+/* copynes_read_packet_into block hook, returns 1 to stop the transfer.  a
+   plugin may send PRG in several packets, the cart puts them together in
+   one section, so everything here goes by the offset in that section */
+static int cache_block(void* ctx, copynes_packet_t pkt, int received)
+{
+	struct cache_match_s* m = (struct cache_match_s*)ctx;
+	uint8_t* prg = 0;
+	size_t total = 0;
+	size_t pos = 0;
+
+	/* the last packet was complete, this is the first block of the next */
+	if((m->size > 0) && (m->received >= m->size) && (m->type == PACKET_PRG_ROM))
+		m->prg_base += m->size;
+	m->type = pkt->type;
+	m->size = pkt->size;
+	m->received = received;
+
+	if(m->state == CACHE_DONE)
+		return 0;
+
+	if(pkt->type != PACKET_PRG_ROM)
+	{
+		if(!m->in_prg)
+			return 0;
+
+		/* the PRG run is over, so its size is known now */
+		if(m->state == CACHE_WAIT_PREFIX)
+		{
+			m->state = CACHE_DONE;
+			return 0;
+		}
+		copynes_cart_section(m->cart, PACKET_PRG_ROM, &prg);
+		cache_verify(m, prg, m->verified, m->prg_base, 1);
+		return cache_offer(m);
+	}
+
+	m->in_prg = 1;
+	copynes_cart_section(m->cart, PACKET_PRG_ROM, &prg);
+	total = m->prg_base + pkt->size;
+	pos = m->prg_base + received;
+
+	if(m->state == CACHE_WAIT_PREFIX)
+	{
+		if(pos < (size_t)m->cache->prefix)
+			return 0;
+
+		cache_lookup(m, prg, total);
+		m->verified = m->cache->prefix;
+		m->state = CACHE_VERIFY;
+	}
+
+	/* the CopyNES only streams, so the verify window is simply the data
+	   that follows the prefix */
+	if(pos > (size_t)(m->cache->prefix + m->cache->verify))
+		pos = m->cache->prefix + m->cache->verify;
+	cache_verify(m, prg, pos, total, 0);
+
+	if(m->ncand == 0)
+	{
+		m->state = CACHE_DONE;
+		return 0;
+	}
+
+	/* seen enough, offer the first dump still matching.  nothing past the
+	   verify window is compared, so only the caller can say it's the same
+	   cart.  a shorter PRG is offered once the packet after it starts */
+	if(pos >= (size_t)(m->cache->prefix + m->cache->verify))
+		return cache_offer(m);
+
+	return 0;
+}
+
+
+/* replace the cart's contents with a cached dump */
+static ssize_t cache_load(copynes_cart_t cart, int fd)
+{
+	int types[CACHE_MAX_SECTIONS];
+	uint32_t sizes[CACHE_MAX_SECTIONS];
+	off_t off = 0;
+	ssize_t total = 0;
+	uint8_t* data = 0;
+	int count = 0;
+	int i = 0;
+
+	if((count = cache_read_header(fd, types, sizes)) < 0)
+		return -FAILED_DATA_READ;
+
+	copynes_cart_clear(cart);
+
+	off = 6 + (count * 5);
+	for(i = 0; i < count; i++)
+	{
+		if((data = copynes_cart_alloc(cart, types[i], sizes[i])) == 0)
+			return -FAILED_NO_MEMORY;
+
+		if(pread(fd, data, sizes[i], off) != (ssize_t)sizes[i])
+			return -FAILED_DATA_READ;
+
+		off += sizes[i];
+		total += sizes[i];
+	}
+
+	return total;
+}
+
+
+copynes_cache_t copynes_cache_open(const char* dir, int prefix_kb, int verify_kb)
+{
+	copynes_cache_t cache = 0;
+
+	if(prefix_kb == 0)
+		prefix_kb = CACHE_PREFIX_KB;
+	if(verify_kb == 0)
+		verify_kb = CACHE_VERIFY_KB;
+
+	if((dir == 0) || (strlen(dir) >= PATH_MAX) || (prefix_kb < 0) || (verify_kb < 0))
+		return 0;
+
+	if((mkdir(dir, 0755) < 0) && (errno != EEXIST))
+		return 0;
+
+	if((cache = calloc(1, sizeof(struct copynes_cache_s))) == 0)
+		return 0;
+
+	strcpy(cache->dir, dir);
+	cache->prefix = KB(prefix_kb);
+	cache->verify = KB(verify_kb);
+
+	return cache;
+}
+
+
+void copynes_cache_close(copynes_cache_t cache)
+{
+	free(cache);
+}
+
+
+int copynes_cache_add(copynes_cache_t cache, copynes_cart_t cart)
+{
+	char dir[PATH_MAX];
+	char path[PATH_MAX + 80];
+	char hex[SHA256_SIZE * 2 + 1];
+	uint8_t hash[SHA256_SIZE];
+	uint8_t* buf = 0;
+	uint8_t* prg = 0;
+	uint8_t* chr = 0;
+	size_t prg_size = 0;
+	size_t chr_size = 0;
+	size_t size = 0;
+	size_t off = 0;
+	uint32_t v = 0;
+	struct stat st;
+	int err = 0;
+
+	if((cache == 0) || (cart == 0))
+		return -1;
+
+	prg_size = copynes_cart_section(cart, PACKET_PRG_ROM, &prg);
+	chr_size = copynes_cart_section(cart, PACKET_CHR_ROM, &chr);
+	if(prg_size < (size_t)cache->prefix)
+		return -1;
+
+	size = 6 + ((chr_size > 0) ? 10 : 5) + prg_size + chr_size;
+	if((buf = malloc(size)) == 0)
+		return -1;
+
+	memcpy(buf, "CNDC", 4);
+	buf[4] = CACHE_VERSION;
+	buf[5] = (chr_size > 0) ? 2 : 1;
+	off = 6;
+
+	buf[off] = PACKET_PRG_ROM;
+	v = htonl(prg_size);
+	memcpy(&buf[off + 1], &v, 4);
+	off += 5;
+	if(chr_size > 0)
+	{
+		buf[off] = PACKET_CHR_ROM;
+		v = htonl(chr_size);
+		memcpy(&buf[off + 1], &v, 4);
+		off += 5;
+	}
+
+	memcpy(&buf[off], prg, prg_size);
+	off += prg_size;
+	if(chr_size > 0)
+		memcpy(&buf[off], chr, chr_size);
+
+	/* the same dump only needs to be stored once */
+	copynes_sha256(buf, size, hash);
+	cache_hex(hash, hex);
+	if(cache_prefix_dir(cache, prg, dir, sizeof(dir)) < 0)
+	{
+		free(buf);
+		return -1;
+	}
+	snprintf(path, sizeof(path), "%s/%s", dir, hex);
+
+	if(stat(path, &st) == 0)
+	{
+		free(buf);
+		return 0;
+	}
+
+	if((mkdir(dir, 0755) < 0) && (errno != EEXIST))
+	{
+		free(buf);
+		return -1;
+	}
+
+	/* a lookup must never trust half a dump, even after a crash */
+	err = copynes_write_file(path, buf, size, 0, 0);
+	free(buf);
+
+	return (err < 0) ? -1 : 0;
+}
+
+
+ssize_t copynes_cache_read(copynes_cache_t cache, copynes_cart_t cart, copynes_t cn, struct timeval timeout,
+						   copynes_cache_accept_fn accept, void* ctx)
+{
+	struct cache_match_s m;
+	ssize_t ret = 0;
+	int i = 0;
+
+	if((cache == 0) || (cart == 0) || (cn == 0))
+		return -FAILED_INVALID_PARAMS;
+
+	memset(&m, 0, sizeof(m));
+	m.cache = cache;
+	m.cart = cart;
+	m.accept = accept;
+	m.ctx = ctx;
+	m.hit = -1;
+
+	ret = copynes_cart_read_into(cart, cn, timeout, cache_block, &m);
+
+	if((ret >= 0) && (m.hit >= 0))
+	{
+		ret = cache_load(cart, m.fds[m.hit]);
+		if(ret < 0)
+			cn->err = -ret;
+	}
+
+	for(i = 0; i < m.ncand; i++)
+		close(m.fds[i]);
+
+	return ret;
+}
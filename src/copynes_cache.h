@@ -0,0 +1,84 @@
+/* -*- Mode: C; indent-tabs-mode: t; c-basic-offset: 4; tab-width: 4 -*- */
+/*
+ * copynes_cache.h
+ * Copyright (C) David Huseby 2009 <dave@linuxprogrammer.org>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with main.c; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor Boston, MA 02110-1301,  USA
+ */
+
+/*
+ * Dump cache.  Complete dumps are kept on disk keyed by the SHA-256 of the
+ * first prefix_kb of their PRG data.  While a cart is being dumped through
+ * the cache, its PRG (the first run of PRG packets, however the plugin
+ * splits it up) is fingerprinted as soon as that much of it came in.  Each
+ * cached dump with the same fingerprint and at least as much PRG as the
+ * plugin announced so far is then checked against the next verify_kb of
+ * the stream; if one still matches and the caller accepts it, the CopyNES
+ * is reset and the cached dump is loaded into the cart instead of waiting
+ * for the rest of the transfer.  PRG that ends before the verify window
+ * is over is offered when the next packet starts, only if its size is
+ * exactly the same.
+ *
+ * A hit is only a match of the first prefix_kb + verify_kb (32K by
+ * default) of PRG.  The rest of PRG and all of CHR are never compared, so
+ * carts sharing their first banks (multicarts, hacks, revisions) look the
+ * same.  That is why nothing is taken from the cache unless the accept
+ * callback says so, e.g. after asking the user or checking a database.
+ *
+ * Only PRG and CHR are cached, a dump taken from the cache has no WRAM.
+ *
+ * Store layout:
+ *
+ *   <dir>/<prefix_kb>k-<prefix SHA-256>/<SHA-256 of the file>
+ *
+ * Cached dump layout, all integers big endian:
+ *
+ *   "CNDC" version(1) section count(1)
+ *   section: type(1) size(4)
+ *   section data, in the same order
+ *
+ * PRG is always the first section.
+ */
+
+#ifndef __LIBCOPYNES_CACHE__
+#define __LIBCOPYNES_CACHE__
+
+#define CACHE_VERSION			1
+#define CACHE_PREFIX_KB			16		/* default fingerprint length */
+#define CACHE_VERIFY_KB			16		/* default verify window */
+
+typedef struct copynes_cache_s *copynes_cache_t;
+
+/* decides whether a cached dump that matched is used, path is the cached
+   file.  return non zero to stop the transfer and take it */
+typedef int (*copynes_cache_accept_fn)(void* ctx, const char* path);
+
+/* open a cache directory, creating it if needed.  0 picks the defaults for
+   prefix_kb and verify_kb */
+copynes_cache_t copynes_cache_open(const char* dir, int prefix_kb, int verify_kb);
+
+void copynes_cache_close(copynes_cache_t cache);
+
+/* store a complete dump, returns 0 or -1 if it can't be stored (e.g. it has
+   less than prefix_kb of PRG) */
+int copynes_cache_add(copynes_cache_t cache, copynes_cart_t cart);
+
+/* copynes_cart_read through the cache.  accept is called at most once; if it
+   takes the match the cart holds the cached dump when this returns.  with a
+   0 accept no match is taken and the whole cart is read */
+ssize_t copynes_cache_read(copynes_cache_t cache, copynes_cart_t cart, copynes_t cn, struct timeval timeout,
+						   copynes_cache_accept_fn accept, void* ctx);
+
+#endif
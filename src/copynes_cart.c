@@ -0,0 +1,421 @@
+/* -*- Mode: C; indent-tabs-mode: t; c-basic-offset: 4; tab-width: 4 -*- */
+/*
+ * copynes_cart.c
+ * Copyright (C) David Huseby 2009 <dave@linuxprogrammer.org>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with main.c; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor Boston, MA 02110-1301,  USA
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <termios.h>
+#include <pthread.h>
+#include <sys/time.h>
+#include <sys/types.h>
+#include <sys/select.h>
+
+#include "copynes.h"
+#include "copynes_private.h"
+#include "copynes_cart.h"
+
+#define CART_INITIAL_SIZE		KB(256)
+#define CART_MAX_SECTIONS		32
+
+/* where a packet landed in the arena */
+struct cart_section_s
+{
+	int type;
+	size_t off;
+	size_t size;
+};
+
+struct copynes_cart_s
+{
+	uint8_t* arena;
+	size_t used;
+	size_t size;
+	int fixed;							/* caller memory, can't grow */
+	int ordered;						/* sections are PRG, CHR, WRAM */
+	int nsections;
+	int last_size;						/* size of the last packet allocated */
+	copynes_block_fn block;				/* the dump cache's block hook */
+	void* block_ctx;
+	struct cart_section_s sections[CART_MAX_SECTIONS];
+};
+
+
+static copynes_cart_t cart_init(uint8_t* arena, size_t size, int fixed)
+{
+	copynes_cart_t cart = 0;
+
+	if((cart = calloc(1, sizeof(struct copynes_cart_s))) == 0)
+		return 0;
+
+	cart->arena = arena;
+	cart->size = size;
+	cart->fixed = fixed;
+	cart->used = CART_HEADER_SIZE;
+	cart->ordered = 1;
+
+	return cart;
+}
+
+
+copynes_cart_t copynes_cart_new()
+{
+	copynes_cart_t cart = 0;
+	uint8_t* arena = 0;
+
+	if((arena = calloc(CART_INITIAL_SIZE, sizeof(uint8_t))) == 0)
+		return 0;
+
+	if((cart = cart_init(arena, CART_INITIAL_SIZE, 0)) == 0)
+		free(arena);
+
+	return cart;
+}
+
+
+copynes_cart_t copynes_cart_new_region(void* base, size_t size)
+{
+	if((base == 0) || (size < CART_HEADER_SIZE))
+		return 0;
+
+	memset(base, 0, CART_HEADER_SIZE);
+
+	return cart_init((uint8_t*)base, size, 1);
+}
+
+
+void copynes_cart_free(copynes_cart_t cart)
+{
+	if(cart == 0)
+		return;
+
+	if(!cart->fixed)
+		free(cart->arena);
+	free(cart);
+}
+
+
+/* the order the sections go in the file */
+static int cart_rank(int type)
+{
+	switch(type)
+	{
+		case PACKET_PRG_ROM:	return 0;
+		case PACKET_CHR_ROM:	return 1;
+		default:				return 2;
+	}
+}
+
+
+/* copynes_read_packet_into allocator: append the packet to the arena */
+static uint8_t* cart_alloc(void* ctx, int type, int size)
+{
+	copynes_cart_t cart = (copynes_cart_t)ctx;
+	struct cart_section_s* last = 0;
+	uint8_t* arena = 0;
+	size_t grow = 0;
+
+	if((cart->used + size) > cart->size)
+	{
+		if(cart->fixed)
+			return 0;
+
+		/* double until the packet fits */
+		grow = cart->size;
+		while((cart->used + size) > grow)
+			grow *= 2;
+
+		if((arena = realloc(cart->arena, grow)) == 0)
+			return 0;
+
+		cart->arena = arena;
+		cart->size = grow;
+	}
+
+	/* a packet following one of the same type just extends it */
+	last = (cart->nsections > 0) ? &cart->sections[cart->nsections - 1] : 0;
+	if((last != 0) && (last->type == type))
+	{
+		last->size += size;
+	}
+	else
+	{
+		if(cart->nsections == CART_MAX_SECTIONS)
+			return 0;
+
+		if((last != 0) && (cart_rank(last->type) > cart_rank(type)))
+			cart->ordered = 0;
+
+		cart->sections[cart->nsections].type = type;
+		cart->sections[cart->nsections].off = cart->used;
+		cart->sections[cart->nsections].size = size;
+		cart->nsections++;
+	}
+
+	arena = cart->arena + cart->used;
+	cart->used += size;
+	cart->last_size = size;
+
+	return arena;
+}
+
+
+uint8_t* copynes_cart_alloc(copynes_cart_t cart, int type, int size)
+{
+	return cart_alloc(cart, type, size);
+}
+
+
+/* copynes_read_packet_into block hook: pass it on */
+static int cart_block(void* ctx, copynes_packet_t pkt, int received)
+{
+	copynes_cart_t cart = (copynes_cart_t)ctx;
+
+	return cart->block(cart->block_ctx, pkt, received);
+}
+
+
+/* drop everything read so far */
+void copynes_cart_clear(copynes_cart_t cart)
+{
+	cart->used = CART_HEADER_SIZE;
+	cart->ordered = 1;
+	cart->nsections = 0;
+	cart->last_size = 0;
+}
+
+
+ssize_t copynes_cart_read(copynes_cart_t cart, copynes_t cn, struct timeval timeout)
+{
+	return copynes_cart_read_into(cart, cn, timeout, 0, 0);
+}
+
+
+/* copynes_cart_read with a block hook for the dump cache */
+ssize_t copynes_cart_read_into(copynes_cart_t cart, copynes_t cn, struct timeval timeout, copynes_block_fn block, void* ctx)
+{
+	struct copynes_packet_s pkt;
+	ssize_t ret = 0;
+	ssize_t total = 0;
+	int ended = 0;
+
+	if((cart == 0) || (cn == 0))
+		return -FAILED_INVALID_PARAMS;
+
+	cart->block = block;
+	cart->block_ctx = ctx;
+
+	while(1)
+	{
+		memset(&pkt, 0, sizeof(pkt));
+
+		if((ret = copynes_read_packet_into(cn, &pkt, timeout, cart_alloc, (block != 0) ? cart_block : 0, cart)) < 0)
+			return ret;
+
+		if(pkt.type == PACKET_EOD)
+			break;
+
+		/* reset packets carry no data, the plugin carries on afterwards */
+		if(pkt.data != 0)
+		{
+			/* MIRROR_STOP would have cut this dump short on another cart */
+			if(ended)
+			{
+				cn->err = FAILED_INVALID_PARAMS;
+				return -cn->err;
+			}
+			if((cn->mirror_mode & MIRROR_STOP) && (cn->mirror_mode & MIRROR_LAST_FLAG(pkt.type)))
+				ended = 1;
+
+			/* give back the tail of a packet trimmed by stopping early, only
+			   the cache's hook may stop anything but the last packet */
+			if(pkt.size < cart->last_size)
+			{
+				if((block == 0) && !(cn->mirror_mode & MIRROR_LAST_FLAG(pkt.type)))
+				{
+					cn->err = FAILED_DUMP_STOPPED;
+					return -cn->err;
+				}
+
+				cart->used -= cart->last_size - pkt.size;
+				cart->sections[cart->nsections - 1].size -= cart->last_size - pkt.size;
+			}
+			total += pkt.size;
+		}
+	}
+
+	return total;
+}
+
+
+/* plugins that send CHR before PRG need their sections shuffled once */
+static int cart_order(copynes_cart_t cart)
+{
+	struct cart_section_s merged[3];
+	uint8_t* tmp = 0;
+	size_t off = 0;
+	int rank = 0;
+	int i = 0;
+
+	if(cart->ordered)
+		return 0;
+
+	if((tmp = malloc(cart->used - CART_HEADER_SIZE)) == 0)
+		return -1;
+
+	/* copy each rank out in arrival order */
+	for(rank = 0; rank < 3; rank++)
+	{
+		merged[rank].type = -1;
+		merged[rank].off = CART_HEADER_SIZE + off;
+		merged[rank].size = 0;
+
+		for(i = 0; i < cart->nsections; i++)
+		{
+			if(cart_rank(cart->sections[i].type) != rank)
+				continue;
+
+			memcpy(tmp + off, cart->arena + cart->sections[i].off, cart->sections[i].size);
+			off += cart->sections[i].size;
+			merged[rank].type = cart->sections[i].type;
+			merged[rank].size += cart->sections[i].size;
+		}
+	}
+
+	memcpy(cart->arena + CART_HEADER_SIZE, tmp, off);
+	free(tmp);
+
+	cart->nsections = 0;
+	for(rank = 0; rank < 3; rank++)
+	{
+		if(merged[rank].size > 0)
+			cart->sections[cart->nsections++] = merged[rank];
+	}
+	cart->ordered = 1;
+
+	return 0;
+}
+
+
+size_t copynes_cart_section(copynes_cart_t cart, int type, uint8_t** data)
+{
+	int i = 0;
+
+	if(data != 0)
+		*data = 0;
+
+	if((cart == 0) || (cart_order(cart) < 0))
+		return 0;
+
+	for(i = 0; i < cart->nsections; i++)
+	{
+		if(cart->sections[i].type == type)
+		{
+			if(data != 0)
+				*data = cart->arena + cart->sections[i].off;
+			return cart->sections[i].size;
+		}
+	}
+
+	return 0;
+}
+
+
+uint8_t* copynes_cart_image(copynes_cart_t cart, int format, int mapper, int mirroring, size_t* size)
+{
+	uint8_t* hdr = 0;
+	size_t prg = 0;
+	size_t chr = 0;
+	size_t wram = 0;
+	size_t prg_units = 0;
+	size_t chr_units = 0;
+	int shift = 0;
+
+	if((cart == 0) || (mapper < 0))
+		return 0;
+
+	prg = copynes_cart_section(cart, PACKET_PRG_ROM, 0);
+	chr = copynes_cart_section(cart, PACKET_CHR_ROM, 0);
+	wram = copynes_cart_section(cart, PACKET_WRAM, 0);
+
+	/* PRG is counted in 16K units, CHR in 8K units */
+	if((prg % KB(16)) || (chr % KB(8)))
+		return 0;
+	prg_units = prg / KB(16);
+	chr_units = chr / KB(8);
+
+	if(format == CART_FORMAT_INES)
+	{
+		if((prg_units > 0xff) || (chr_units > 0xff) || (mapper > 0xff))
+			return 0;
+	}
+	else if(format == CART_FORMAT_NES2)
+	{
+		/* units of 0xf00 and up switch to exponent notation, not needed
+		   for anything the CopyNES can dump */
+		if((prg_units > 0xeff) || (chr_units > 0xeff) || (mapper > 0xfff))
+			return 0;
+	}
+	else
+	{
+		return 0;
+	}
+
+	hdr = cart->arena;
+	memset(hdr, 0, CART_HEADER_SIZE);
+	hdr[0] = 'N';
+	hdr[1] = 'E';
+	hdr[2] = 'S';
+	hdr[3] = 0x1a;
+	hdr[4] = prg_units & 0xff;
+	hdr[5] = chr_units & 0xff;
+
+	/* flags 6: mirroring, battery, four screen and the low mapper nibble */
+	if(mirroring == MIRRORING_VERTICAL)
+		hdr[6] |= 0x01;
+	if(wram > 0)
+		hdr[6] |= 0x02;
+	if(mirroring == MIRRORING_4SCREEN)
+		hdr[6] |= 0x08;
+	hdr[6] |= (mapper & 0x0f) << 4;
+
+	/* flags 7: the next mapper nibble */
+	hdr[7] = mapper & 0xf0;
+
+	if(format == CART_FORMAT_NES2)
+	{
+		hdr[7] |= 0x08;
+		hdr[8] = (mapper >> 8) & 0x0f;
+		hdr[9] = (((chr_units >> 8) & 0x0f) << 4) | ((prg_units >> 8) & 0x0f);
+
+		/* battery backed PRG-RAM is 64 << shift bytes */
+		if(wram > 0)
+		{
+			for(shift = 1; (shift < 15) && (((size_t)64 << shift) < wram); shift++)
+				;
+			hdr[10] = shift << 4;
+		}
+	}
+
+	if(size != 0)
+		*size = CART_HEADER_SIZE + prg + chr;
+
+	return hdr;
+}
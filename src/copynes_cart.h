@@ -0,0 +1,63 @@
+/* -*- Mode: C; indent-tabs-mode: t; c-basic-offset: 4; tab-width: 4 -*- */
+/*
+ * copynes_cart.h
+ * Copyright (C) David Huseby 2009 <dave@linuxprogrammer.org>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with main.c; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor Boston, MA 02110-1301,  USA
+ */
+
+/*
+ * Cart images.  The packets of a dump are read straight into one arena
+ * behind a reserved 16 byte header, so once the plugin is done the arena
+ * already is an iNES file and only the header has to be filled in.  WRAM
+ * lands after the CHR data, outside of the image.
+ */
+
+#ifndef __LIBCOPYNES_CART__
+#define __LIBCOPYNES_CART__
+
+/* image formats */
+#define CART_FORMAT_INES		0
+#define CART_FORMAT_NES2		1
+
+#define CART_HEADER_SIZE		16
+
+typedef struct copynes_cart_s *copynes_cart_t;
+
+/* create a cart with an arena that grows as packets come in */
+copynes_cart_t copynes_cart_new();
+
+/* create a cart on top of caller memory (e.g. an mmap'd file), the arena
+   never grows past size */
+copynes_cart_t copynes_cart_new_region(void* base, size_t size);
+
+void copynes_cart_free(copynes_cart_t cart);
+
+/* read packets from a running plugin until PACKET_EOD, returns the number
+   of data bytes read.  fails with "dump stopped before its last packet" if
+   a packet not marked MIRROR_LAST_* got stopped, and with "invalid
+   parameters" if the plugin sends data after a packet MIRROR_STOP was told
+   is the last one */
+ssize_t copynes_cart_read(copynes_cart_t cart, copynes_t cn, struct timeval timeout);
+
+/* fill in the header and return the image: header, PRG and then CHR.
+   mirroring is one of the MIRRORING_* values.  returns 0 if the sizes
+   can't be described by the format */
+uint8_t* copynes_cart_image(copynes_cart_t cart, int format, int mapper, int mirroring, size_t* size);
+
+/* get the data of one packet type, returns its size */
+size_t copynes_cart_section(copynes_cart_t cart, int type, uint8_t** data);
+
+#endif
@@ -0,0 +1,338 @@
+/* -*- Mode: C; indent-tabs-mode: t; c-basic-offset: 4; tab-width: 4 -*- */
+/*
+ * copynes_discover.c
+ * Copyright (C) David Huseby 2009 <dave@linuxprogrammer.org>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with main.c; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor Boston, MA 02110-1301,  USA
+ */
+
+/*
+ * For every tty in <sysfs>/class/tty the "device" link points at the USB
+ * interface's tty node:
+ *
+ *   .../usb1/1-1/1-1:1.0/ttyUSB0
+ *
+ * so the interface directory (bInterfaceNumber) is one level up and the
+ * USB device directory (idVendor, idProduct, serial, product) is two levels
+ * up.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <limits.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#if defined __linux__
+#include <sys/inotify.h>
+#endif
+
+#include "copynes_discover.h"
+
+#define DISCOVER_MAX_DEVICES	32
+
+static pthread_mutex_t discover_lock = PTHREAD_MUTEX_INITIALIZER;
+static char sysfs_root[DISCOVER_PATH_MAX] = "/sys";
+static char dev_root[DISCOVER_PATH_MAX] = "/dev";
+static int match_vid = DISCOVER_VID;
+static int match_pid = DISCOVER_PID;
+static char match_serial[64] = "";
+static char match_product[64] = "";
+
+/* the cached result */
+static int cache_valid = 0;
+static int cache_count = 0;
+static struct copynes_device_s cache[DISCOVER_MAX_DEVICES];
+
+
+/* read the first line of a sysfs attribute */
+static int discover_read_attr(const char* dir, const char* attr, char* buf, size_t size)
+{
+	char path[PATH_MAX];
+	FILE* f = 0;
+	size_t len = 0;
+
+	snprintf(path, sizeof(path), "%s/%s", dir, attr);
+	if((f = fopen(path, "r")) == 0)
+		return -1;
+
+	if(fgets(buf, size, f) == 0)
+	{
+		fclose(f);
+		return -1;
+	}
+	fclose(f);
+
+	/* strip the newline */
+	len = strlen(buf);
+	if((len > 0) && (buf[len - 1] == '\n'))
+		buf[len - 1] = '\0';
+
+	return 0;
+}
+
+
+static int discover_read_hex(const char* dir, const char* attr)
+{
+	char buf[32];
+
+	if(discover_read_attr(dir, attr, buf, sizeof(buf)) < 0)
+		return -1;
+
+	return (int)strtol(buf, 0, 16);
+}
+
+
+/* chop the last path component off */
+static void discover_parent(char* path)
+{
+	char* slash = strrchr(path, '/');
+
+	if(slash != 0)
+		*slash = '\0';
+}
+
+
+/* find or add the device on a USB port */
+static struct copynes_device_s* discover_slot(struct copynes_device_s* devs, int* count, const char* port)
+{
+	int i = 0;
+
+	for(i = 0; i < *count; i++)
+	{
+		if(strcmp(devs[i].port, port) == 0)
+			return &devs[i];
+	}
+
+	if(*count == DISCOVER_MAX_DEVICES)
+		return 0;
+
+	memset(&devs[*count], 0, sizeof(struct copynes_device_s));
+	strncpy(devs[*count].port, port, sizeof(devs[*count].port) - 1);
+
+	return &devs[(*count)++];
+}
+
+
+static int discover_compare(const void* a, const void* b)
+{
+	return strcmp(((const struct copynes_device_s*)a)->port, ((const struct copynes_device_s*)b)->port);
+}
+
+
+/* walk sysfs, called locked */
+static int discover_scan()
+{
+	struct copynes_device_s found[DISCOVER_MAX_DEVICES];
+	struct copynes_device_s* dev = 0;
+	struct dirent* ent = 0;
+	char path[PATH_MAX];
+	char iface[PATH_MAX];
+	char usb[PATH_MAX];
+	char serial[64];
+	char product[64];
+	int count = 0;
+	int ifnum = 0;
+	int i = 0;
+	DIR* dir = 0;
+
+	snprintf(path, sizeof(path), "%s/class/tty", sysfs_root);
+	if((dir = opendir(path)) == 0)
+		return -1;
+
+	while((ent = readdir(dir)) != 0)
+	{
+		if(ent->d_name[0] == '.')
+			continue;
+
+		/* resolve the tty's device link to its interface */
+		snprintf(path, sizeof(path), "%s/class/tty/%s/device", sysfs_root, ent->d_name);
+		if(realpath(path, iface) == 0)
+			continue;
+		discover_parent(iface);
+
+		strcpy(usb, iface);
+		discover_parent(usb);
+
+		if((discover_read_hex(usb, "idVendor") != match_vid) ||
+		   (discover_read_hex(usb, "idProduct") != match_pid))
+			continue;
+
+		if(discover_read_attr(usb, "serial", serial, sizeof(serial)) < 0)
+			serial[0] = '\0';
+		if(strncmp(serial, match_serial, strlen(match_serial)) != 0)
+			continue;
+
+		if(discover_read_attr(usb, "product", product, sizeof(product)) < 0)
+			product[0] = '\0';
+		if(strncmp(product, match_product, strlen(match_product)) != 0)
+			continue;
+
+		if((ifnum = discover_read_hex(iface, "bInterfaceNumber")) < 0)
+			continue;
+
+		/* the USB device directory is named after its port */
+		if((dev = discover_slot(found, &count, strrchr(usb, '/') ? strrchr(usb, '/') + 1 : usb)) == 0)
+			continue;
+
+		strncpy(dev->serial, serial, sizeof(dev->serial) - 1);
+		strncpy(dev->product, product, sizeof(dev->product) - 1);
+		dev->stock_ids = (match_vid == DISCOVER_VID) && (match_pid == DISCOVER_PID) &&
+						 (match_serial[0] == '\0') && (match_product[0] == '\0');
+
+		/* a path that doesn't fit couldn't be opened, leave it out */
+		if(ifnum == 0)
+		{
+			if(snprintf(dev->data_device, sizeof(dev->data_device), "%s/%s", dev_root, ent->d_name) >= (int)sizeof(dev->data_device))
+				dev->data_device[0] = '\0';
+		}
+		else if(ifnum == 1)
+		{
+			if(snprintf(dev->control_device, sizeof(dev->control_device), "%s/%s", dev_root, ent->d_name) >= (int)sizeof(dev->control_device))
+				dev->control_device[0] = '\0';
+		}
+	}
+	closedir(dir);
+
+	/* only keep devices with both channels */
+	cache_count = 0;
+	for(i = 0; i < count; i++)
+	{
+		if((found[i].data_device[0] != '\0') && (found[i].control_device[0] != '\0'))
+			cache[cache_count++] = found[i];
+	}
+
+	/* keep the order stable between scans */
+	qsort(cache, cache_count, sizeof(struct copynes_device_s), discover_compare);
+	cache_valid = 1;
+
+	return cache_count;
+}
+
+
+int copynes_discover(struct copynes_device_s* devs, int max)
+{
+	int ret = 0;
+
+	pthread_mutex_lock(&discover_lock);
+
+	if(!cache_valid)
+		ret = discover_scan();
+
+	if(ret >= 0)
+	{
+		ret = cache_count;
+		if((devs != 0) && (max > 0))
+			memcpy(devs, cache, ((ret < max) ? ret : max) * sizeof(struct copynes_device_s));
+	}
+
+	pthread_mutex_unlock(&discover_lock);
+
+	return ret;
+}
+
+
+void copynes_discover_flush()
+{
+	pthread_mutex_lock(&discover_lock);
+	cache_valid = 0;
+	pthread_mutex_unlock(&discover_lock);
+}
+
+
+void copynes_discover_set_root(const char* sysfs, const char* dev)
+{
+	pthread_mutex_lock(&discover_lock);
+	snprintf(sysfs_root, sizeof(sysfs_root), "%s", (sysfs != 0) ? sysfs : "/sys");
+	snprintf(dev_root, sizeof(dev_root), "%s", (dev != 0) ? dev : "/dev");
+	cache_valid = 0;
+	pthread_mutex_unlock(&discover_lock);
+}
+
+
+void copynes_discover_set_match(int vid, int pid, const char* serial, const char* product)
+{
+	pthread_mutex_lock(&discover_lock);
+	match_vid = vid;
+	match_pid = pid;
+	snprintf(match_serial, sizeof(match_serial), "%s", (serial != 0) ? serial : "");
+	snprintf(match_product, sizeof(match_product), "%s", (product != 0) ? product : "");
+	cache_valid = 0;
+	pthread_mutex_unlock(&discover_lock);
+}
+
+
+int copynes_discover_watch()
+{
+#if defined __linux__
+	int fd = -1;
+
+	if((fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC)) < 0)
+		return -1;
+
+	pthread_mutex_lock(&discover_lock);
+	if(inotify_add_watch(fd, dev_root, IN_CREATE | IN_DELETE | IN_ATTRIB) < 0)
+	{
+		pthread_mutex_unlock(&discover_lock);
+		close(fd);
+		return -1;
+	}
+	pthread_mutex_unlock(&discover_lock);
+
+	return fd;
+#else
+	return -1;
+#endif
+}
+
+
+int copynes_discover_changed(int fd)
+{
+#if defined __linux__
+	char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+	const struct inotify_event* ev = 0;
+	ssize_t len = 0;
+	ssize_t off = 0;
+	int changed = 0;
+
+	/* drain every queued event */
+	while((len = read(fd, buf, sizeof(buf))) > 0)
+	{
+		for(off = 0; off < len; off += sizeof(struct inotify_event) + ev->len)
+		{
+			ev = (const struct inotify_event*)&buf[off];
+
+			/* udev fixes up permissions after creating the node, so an
+			   attribute change means the tty is ready to open */
+			if((ev->len > 0) && (strncmp(ev->name, "tty", 3) == 0))
+				changed = 1;
+		}
+	}
+
+	if(changed)
+		copynes_discover_flush();
+
+	return changed;
+#else
+	return 0;
+#endif
+}
@@ -0,0 +1,81 @@
+/* -*- Mode: C; indent-tabs-mode: t; c-basic-offset: 4; tab-width: 4 -*- */
+/*
+ * copynes_discover.h
+ * Copyright (C) David Huseby 2009 <dave@linuxprogrammer.org>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with main.c; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor Boston, MA 02110-1301,  USA
+ */
+
+/*
+ * Finding CopyNES devices on Linux.  The FTDI chip in the CopyNES shows up
+ * as two ttys, interface 0 is the data channel and interface 1 is the
+ * control channel.  sysfs is walked to find the ttys of every matching USB
+ * device and pair them up.
+ *
+ * WARNING: the CopyNES uses FTDI's stock FT2232 ids, so out of the box
+ * every FT2232 board plugged in (JTAG adapters, dev boards, other serial
+ * gear) is reported as a CopyNES too, and copynes_open on it toggles its
+ * DTR/RTS lines, which resets a lot of that hardware.  When anything else
+ * with an FT2232 may be attached, set a serial number or product string
+ * with copynes_discover_set_match first.  Devices found on the stock ids
+ * alone have their stock_ids flag set, so a tool can warn before opening.
+ */
+
+#ifndef __LIBCOPYNES_DISCOVER__
+#define __LIBCOPYNES_DISCOVER__
+
+/* the FT2232 in the CopyNES uses FTDI's default ids */
+#define DISCOVER_VID			0x0403
+#define DISCOVER_PID			0x6010
+
+#define DISCOVER_PATH_MAX		256
+
+struct copynes_device_s
+{
+	char data_device[DISCOVER_PATH_MAX];	/* pass these two to copynes_open */
+	char control_device[DISCOVER_PATH_MAX];
+	char serial[64];						/* USB serial number, may be empty */
+	char product[64];						/* USB product string, may be empty */
+	char port[64];							/* USB port, e.g. "1-1.4" */
+	int stock_ids;							/* matched on FTDI's stock ids alone,
+											   could be any FT2232 board */
+};
+
+/* find CopyNES devices, returns how many were found (at most max are stored
+   in devs) or -1 if sysfs can't be read.  the result is cached until
+   copynes_discover_flush or a change seen by copynes_discover_changed */
+int copynes_discover(struct copynes_device_s* devs, int max);
+
+/* drop the cached result */
+void copynes_discover_flush();
+
+/* look somewhere other than /sys and /dev, e.g. when a container or chroot
+   has the host's sysfs mounted elsewhere.  0 puts back the default */
+void copynes_discover_set_root(const char* sysfs_root, const char* dev_root);
+
+/* match other ids and narrow the match down.  serial and product may be 0
+   to match anything, or a prefix the USB serial number / product string
+   has to start with */
+void copynes_discover_set_match(int vid, int pid, const char* serial, const char* product);
+
+/* start watching the dev root for ttys coming and going.  returns a non
+   blocking fd to poll for reading, or -1 */
+int copynes_discover_watch();
+
+/* call when the watch fd polls readable, returns 1 if ttys were added or
+   removed (the cache has been dropped) and 0 if not */
+int copynes_discover_changed(int fd);
+
+#endif
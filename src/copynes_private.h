@@ -0,0 +1,183 @@
+/* -*- Mode: C; indent-tabs-mode: t; c-basic-offset: 4; tab-width: 4 -*- */
+/*
+ * copynes_private.h
+ * Copyright (C) David Huseby 2009 <dave@linuxprogrammer.org>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with main.c; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor Boston, MA 02110-1301,  USA
+ */
+
+/*
+ * Library internals shared between the source files.  Nothing in here is
+ * part of the public interface.
+ */
+
+#ifndef __LIBCOPYNES_PRIVATE__
+#define __LIBCOPYNES_PRIVATE__
+
+#define KB(x) (x * 1024)
+
+/* error codes */
+#define FAILED_DATA_OPEN 		1
+#define FAILED_CONTROL_OPEN 	2
+#define FAILED_COMMAND_SEND 	3
+#define FAILED_PLUGIN_OPEN 		4
+#define FAILED_BLOCK_SEND		5
+#define FAILED_DATA_READ		6
+#define FAILED_INVALID_PARAMS	7
+#define FAILED_DATA_WRITE		8
+#define FAILED_IO_ENGINE		9
+#define FAILED_NO_MEMORY		10
+#define FAILED_CANCELLED		ERROR_CANCELLED
+#define FAILED_DUMP_STOPPED		12
+
+/* the MIRROR_LAST_* flag for a packet type, 0 if it can't be marked */
+#define MIRROR_LAST_FLAG(type)	(((type) == PACKET_PRG_ROM) ? MIRROR_LAST_PRG : \
+								 (((type) == PACKET_CHR_ROM) ? MIRROR_LAST_CHR : 0))
+
+/* hands copynes_read_packet_into the buffer for a packet's data */
+typedef uint8_t* (*copynes_alloc_fn)(void* ctx, int type, int size);
+
+/* called by copynes_read_packet_into after every 1K of packet data with the
+   number of bytes received so far, returning non zero stops the plugin and
+   ends the dump like MIRROR_STOP does */
+typedef int (*copynes_block_fn)(void* ctx, copynes_packet_t pkt, int received);
+
+/* cancellation handle, rfd polls readable once cancelled */
+struct copynes_cancel_s
+{
+	int rfd;
+	int wfd;							/* same as rfd for an eventfd */
+};
+
+/* per handle io_uring state, see copynes_uring.c */
+struct copynes_uring_s
+{
+	copynes_ring_t ring;
+	int owned;							/* ring was created for this handle */
+	int slot;							/* our slice of the registered buffer */
+	int read_pending;					/* a read is queued in the ring */
+	int read_off;						/* unconsumed completed read data */
+	int read_len;
+	int read_res;
+	int write_queued;					/* sqes prepared but not submitted */
+	int write_inflight;					/* submitted but not completed */
+	int write_used;						/* bytes of write staging in use */
+	int write_err;						/* a queued write failed */
+	int batching;						/* defer submitting writes */
+	void* last_write;					/* sqe of the last queued write */
+	uint8_t* rbuf;
+	uint8_t* wbuf;
+};
+
+/* background reader, see copynes_reader.c.  head and flush_req are only
+   written by the consumer, tail, flush_ack and flush_tail only by the
+   reader thread */
+struct copynes_reader_s
+{
+	int running;
+	int err;							/* the reader thread hit a read error */
+	int stopping;						/* the stop fd means stop, not flush */
+	unsigned int flush_req;				/* bumped by copynes_reader_flush */
+	unsigned int flush_ack;				/* flush_req the thread last saw */
+	size_t flush_tail;					/* tail when it saw it */
+	int owned;							/* buf was allocated by the library */
+	uint8_t* buf;
+	size_t size;						/* a power of two */
+	int data_rfd;						/* signalled when data comes in */
+	int data_wfd;
+	int space_rfd;						/* signalled when data is consumed */
+	int space_wfd;
+	int stop_rfd;
+	int stop_wfd;
+	pthread_t thread;
+	size_t head __attribute__((aligned(64)));
+	int consumer_waiting;
+	size_t tail __attribute__((aligned(64)));
+	int producer_waiting;
+};
+
+/* CopyNES state */
+struct copynes_s
+{
+	int data;
+	int control;
+    int status;
+	int err;
+	int rbyte;
+	int rcount;
+	int read_mode;
+	int engine;
+	int mirror_mode;
+	int stopped;						/* next packet is a fake PACKET_EOD */
+#if defined COPYNES_NO_HEAP
+	char data_device[COPYNES_PATH_MAX];
+	char control_device[COPYNES_PATH_MAX];
+#else
+	char* data_device;
+	char* control_device;
+#endif
+	fd_set readfds;
+	fd_set exceptfds;
+	uint8_t uservar_enabled[4];
+	uint8_t uservar_value[4];
+	struct termios old_tios_data_device;
+	struct termios old_tios_control_device;
+	uint8_t plugin[KB(1)];				/* the loaded plugin, resent after a reset */
+	int plugin_last;					/* type of the last packet it sent in a whole dump */
+	int run_last;						/* type of the last packet of this run */
+	struct copynes_uring_s uring;
+	struct copynes_reader_s reader;
+	copynes_cancel_t cancel;
+};
+
+/* the packet state machine behind copynes_read_packet */
+ssize_t copynes_read_packet_into(copynes_t cn, copynes_packet_t pkt, struct timeval timeout, copynes_alloc_fn alloc, copynes_block_fn block, void* ctx);
+
+/* cart internals for the dump cache, see copynes_cart.c */
+struct copynes_cart_s;
+ssize_t copynes_cart_read_into(struct copynes_cart_s* cart, copynes_t cn, struct timeval timeout, copynes_block_fn block, void* ctx);
+uint8_t* copynes_cart_alloc(struct copynes_cart_s* cart, int type, int size);
+void copynes_cart_clear(struct copynes_cart_s* cart);
+
+/* write hdr then data to path so that either the old or the complete new
+   file is there after a crash, see copynes_wram.c */
+int copynes_write_file(const char* path, const uint8_t* hdr, size_t hdr_size, const uint8_t* data, size_t size);
+
+/* SHA-256 of data, see copynes_sha256.c */
+#define SHA256_SIZE				32
+void copynes_sha256(const uint8_t* data, size_t size, uint8_t* out);
+
+/* wakeup fds shared by the cancel handles and the reader thread */
+int copynes_wakeup_new(int* rfd, int* wfd);
+void copynes_wakeup_free(int rfd, int wfd);
+void copynes_wakeup_signal(int rfd, int wfd);
+void copynes_wakeup_drain(int rfd);
+
+/* background reader */
+int copynes_reader_start(copynes_t cn, void* buf, size_t size);
+void copynes_reader_stop(copynes_t cn);
+ssize_t copynes_reader_read(copynes_t cn, void* buf, size_t count, struct timeval *timeout);
+void copynes_reader_flush(copynes_t cn);
+
+/* io_uring engine, only built when COPYNES_HAVE_IO_URING is defined */
+int copynes_uring_attach(copynes_t cn, copynes_ring_t ring);
+void copynes_uring_detach(copynes_t cn);
+void copynes_uring_flush(copynes_t cn);
+ssize_t copynes_uring_read(copynes_t cn, void* buf, size_t count, struct timeval *timeout);
+ssize_t copynes_uring_write(copynes_t cn, void* buf, size_t size);
+void copynes_uring_begin_batch(copynes_t cn);
+int copynes_uring_end_batch(copynes_t cn);
+
+#endif
@@ -0,0 +1,350 @@
+/* -*- Mode: C; indent-tabs-mode: t; c-basic-offset: 4; tab-width: 4 -*- */
+/*
+ * copynes_reader.c
+ * Copyright (C) David Huseby 2009 <dave@linuxprogrammer.org>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with main.c; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor Boston, MA 02110-1301,  USA
+ */
+
+/*
+ * Background reader.  A thread per handle keeps draining the data channel
+ * into a single producer/single consumer ring so the FTDI chip never has
+ * to hold off the CopyNES while the application is busy elsewhere.
+ * copynes_read then takes its data out of the ring.
+ *
+ * The ring is lock free: the reader thread only moves tail, the consumer
+ * only moves head.  Either side that runs out (data or space) raises its
+ * waiting flag, checks again and then sleeps on a wakeup fd; the other
+ * side only signals the fd when it sees the flag, so the fast path has no
+ * syscalls beyond the read() itself.
+ *
+ * A flush has to get rid of data the thread is still reading, so it hands
+ * the thread a new flush_req through the stop fd and waits for the ack.
+ * The thread throws away a chunk whose read() overlapped a flush request
+ * and acks with its tail, everything up to there is stale.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <errno.h>
+#include <unistd.h>
+#include <termios.h>
+#include <string.h>
+#include <pthread.h>
+#include <sys/time.h>
+#include <sys/types.h>
+#include <sys/select.h>
+
+#include "copynes.h"
+#include "copynes_private.h"
+
+#define READER_MIN_SIZE			KB(4)
+
+
+/* wait for fd (and optionally a cancel or stop fd) to poll readable */
+static int reader_wait(int fd, int other, struct timeval *timeout)
+{
+	fd_set readfds;
+	int nfds = fd;
+	int ret = 0;
+
+	FD_ZERO(&readfds);
+	FD_SET(fd, &readfds);
+	if(other >= 0)
+	{
+		FD_SET(other, &readfds);
+		if(other > nfds)
+			nfds = other;
+	}
+
+	if((ret = select(nfds + 1, &readfds, 0, 0, timeout)) < 0)
+		return (errno == EINTR) ? 0 : -1;
+
+	/* the other fd wins so a stop or cancel is never missed */
+	if((ret > 0) && (other >= 0) && FD_ISSET(other, &readfds))
+		return 2;
+
+	return ret;
+}
+
+
+/* the stop fd went off, returns non zero if it is a stop rather than a
+   flush request, which the top of the loop answers */
+static int reader_stopped(struct copynes_reader_s* r)
+{
+	copynes_wakeup_drain(r->stop_rfd);
+	return __atomic_load_n(&r->stopping, __ATOMIC_SEQ_CST);
+}
+
+
+static void* reader_thread(void* arg)
+{
+	copynes_t cn = (copynes_t)arg;
+	struct copynes_reader_s* r = &cn->reader;
+	size_t tail = r->tail;
+	size_t head = 0;
+	size_t space = 0;
+	size_t off = 0;
+	ssize_t bytes = 0;
+	unsigned int flush = 0;
+	int ret = 0;
+
+	while(1)
+	{
+		/* answer a flush, nothing read before this point is published */
+		flush = __atomic_load_n(&r->flush_req, __ATOMIC_SEQ_CST);
+		if(flush != r->flush_ack)
+		{
+			r->flush_tail = tail;
+			__atomic_store_n(&r->flush_ack, flush, __ATOMIC_SEQ_CST);
+			copynes_wakeup_signal(r->data_rfd, r->data_wfd);
+		}
+
+		head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+		space = r->size - (tail - head);
+
+		/* ring full, wait for the consumer */
+		if(space == 0)
+		{
+			__atomic_store_n(&r->producer_waiting, 1, __ATOMIC_SEQ_CST);
+			if(__atomic_load_n(&r->head, __ATOMIC_SEQ_CST) == head)
+			{
+				if((reader_wait(r->space_rfd, r->stop_rfd, 0) == 2) && reader_stopped(r))
+					break;
+				copynes_wakeup_drain(r->space_rfd);
+			}
+			__atomic_store_n(&r->producer_waiting, 0, __ATOMIC_SEQ_CST);
+			continue;
+		}
+
+		if((ret = reader_wait(cn->data, r->stop_rfd, 0)) == 2)
+		{
+			if(reader_stopped(r))
+				break;
+			continue;
+		}
+		if(ret <= 0)
+			continue;
+
+		/* read straight into the ring, up to the wrap */
+		off = tail & (r->size - 1);
+		if(space > (r->size - off))
+			space = r->size - off;
+
+		if((bytes = read(cn->data, &r->buf[off], space)) < 0)
+		{
+			if((errno == EAGAIN) || (errno == EINTR))
+				continue;
+			__atomic_store_n(&r->err, 1, __ATOMIC_SEQ_CST);
+			copynes_wakeup_signal(r->data_rfd, r->data_wfd);
+			break;
+		}
+
+		/* the read may have picked up data from before a flush */
+		if(__atomic_load_n(&r->flush_req, __ATOMIC_SEQ_CST) != flush)
+			continue;
+
+		tail += bytes;
+		__atomic_store_n(&r->tail, tail, __ATOMIC_SEQ_CST);
+
+		if(__atomic_load_n(&r->consumer_waiting, __ATOMIC_SEQ_CST))
+			copynes_wakeup_signal(r->data_rfd, r->data_wfd);
+	}
+
+	return 0;
+}
+
+
+static void reader_free_buf(struct copynes_reader_s* r)
+{
+#if !defined COPYNES_NO_HEAP
+	if(r->owned)
+		free(r->buf);
+#endif
+	memset(r, 0, sizeof(*r));
+}
+
+
+/* start the reader thread on a ring of buf, or of a new buffer of at least
+   size bytes if buf is 0 */
+int copynes_reader_start(copynes_t cn, void* buf, size_t size)
+{
+	struct copynes_reader_s* r = &cn->reader;
+	size_t ring = READER_MIN_SIZE;
+
+	memset(r, 0, sizeof(*r));
+	r->data_rfd = r->space_rfd = r->stop_rfd = -1;
+
+	if(buf != 0)
+	{
+		/* use the biggest power of two that fits, the index is a mask */
+		if(size < READER_MIN_SIZE)
+			return -1;
+		while((ring * 2) <= size)
+			ring *= 2;
+		r->buf = (uint8_t*)buf;
+	}
+	else
+	{
+#if defined COPYNES_NO_HEAP
+		return -1;
+#else
+		/* round up to a power of two so the index is a mask */
+		while(ring < size)
+			ring *= 2;
+		if((r->buf = malloc(ring)) == 0)
+			return -1;
+		r->owned = 1;
+#endif
+	}
+	r->size = ring;
+
+	if((copynes_wakeup_new(&r->data_rfd, &r->data_wfd) < 0) ||
+	   (copynes_wakeup_new(&r->space_rfd, &r->space_wfd) < 0) ||
+	   (copynes_wakeup_new(&r->stop_rfd, &r->stop_wfd) < 0) ||
+	   (pthread_create(&r->thread, 0, reader_thread, cn) != 0))
+	{
+		if(r->data_rfd >= 0)
+			copynes_wakeup_free(r->data_rfd, r->data_wfd);
+		if(r->space_rfd >= 0)
+			copynes_wakeup_free(r->space_rfd, r->space_wfd);
+		if(r->stop_rfd >= 0)
+			copynes_wakeup_free(r->stop_rfd, r->stop_wfd);
+		reader_free_buf(r);
+		return -1;
+	}
+
+	r->running = 1;
+
+	return 0;
+}
+
+
+void copynes_reader_stop(copynes_t cn)
+{
+	struct copynes_reader_s* r = &cn->reader;
+
+	if(!r->running)
+		return;
+
+	__atomic_store_n(&r->stopping, 1, __ATOMIC_SEQ_CST);
+	copynes_wakeup_signal(r->stop_rfd, r->stop_wfd);
+	pthread_join(r->thread, 0);
+
+	copynes_wakeup_free(r->data_rfd, r->data_wfd);
+	copynes_wakeup_free(r->space_rfd, r->space_wfd);
+	copynes_wakeup_free(r->stop_rfd, r->stop_wfd);
+	reader_free_buf(r);
+}
+
+
+ssize_t copynes_reader_read(copynes_t cn, void* buf, size_t count, struct timeval *timeout)
+{
+	struct copynes_reader_s* r = &cn->reader;
+	size_t head = r->head;
+	size_t avail = 0;
+	size_t off = 0;
+	size_t n = 0;
+	size_t i = 0;
+	int ret = 0;
+
+	while(i < count)
+	{
+		avail = __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE) - head;
+
+		if(avail > 0)
+		{
+			/* copy out, in two pieces if the data wraps */
+			if(avail > (count - i))
+				avail = count - i;
+			off = head & (r->size - 1);
+			n = ((r->size - off) < avail) ? (r->size - off) : avail;
+			memcpy((uint8_t*)buf + i, &r->buf[off], n);
+			if(n < avail)
+				memcpy((uint8_t*)buf + i + n, r->buf, avail - n);
+
+			head += avail;
+			i += avail;
+			__atomic_store_n(&r->head, head, __ATOMIC_SEQ_CST);
+
+			if(__atomic_load_n(&r->producer_waiting, __ATOMIC_SEQ_CST))
+				copynes_wakeup_signal(r->space_rfd, r->space_wfd);
+			continue;
+		}
+
+		if(__atomic_load_n(&r->err, __ATOMIC_SEQ_CST))
+		{
+			cn->err = FAILED_DATA_READ;
+			return -cn->err;
+		}
+
+		/* check to see if we've run out of time */
+		if((timeout != 0) && (timeout->tv_sec <= 0) && (timeout->tv_usec <= 0))
+			break;
+
+		/* nothing buffered, sleep until the reader thread has something */
+		ret = 0;
+		__atomic_store_n(&r->consumer_waiting, 1, __ATOMIC_SEQ_CST);
+		if(__atomic_load_n(&r->tail, __ATOMIC_SEQ_CST) == head)
+			ret = reader_wait(r->data_rfd, (cn->cancel != 0) ? cn->cancel->rfd : -1, timeout);
+		__atomic_store_n(&r->consumer_waiting, 0, __ATOMIC_SEQ_CST);
+		copynes_wakeup_drain(r->data_rfd);
+
+		if(ret < 0)
+		{
+			cn->err = FAILED_DATA_READ;
+			return -cn->err;
+		}
+
+		if(ret == 2)
+		{
+			cn->err = FAILED_CANCELLED;
+			return -cn->err;
+		}
+	}
+
+	return (ssize_t)i;
+}
+
+
+/* throw away everything buffered, e.g. after a reset.  waits for the
+   thread to ack so a read() it is in the middle of can't publish stale
+   data afterwards */
+void copynes_reader_flush(copynes_t cn)
+{
+	struct copynes_reader_s* r = &cn->reader;
+	unsigned int flush = r->flush_req + 1;
+
+	__atomic_store_n(&r->flush_req, flush, __ATOMIC_SEQ_CST);
+	copynes_wakeup_signal(r->stop_rfd, r->stop_wfd);
+
+	/* a thread that died on a read error never answers */
+	while((__atomic_load_n(&r->flush_ack, __ATOMIC_SEQ_CST) != flush) &&
+		  !__atomic_load_n(&r->err, __ATOMIC_SEQ_CST))
+	{
+		if(reader_wait(r->data_rfd, -1, 0) < 0)
+			break;
+		copynes_wakeup_drain(r->data_rfd);
+	}
+
+	if(__atomic_load_n(&r->flush_ack, __ATOMIC_SEQ_CST) == flush)
+		__atomic_store_n(&r->head, r->flush_tail, __ATOMIC_SEQ_CST);
+	else
+		__atomic_store_n(&r->head, __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE), __ATOMIC_SEQ_CST);
+
+	if(__atomic_load_n(&r->producer_waiting, __ATOMIC_SEQ_CST))
+		copynes_wakeup_signal(r->space_rfd, r->space_wfd);
+}
@@ -0,0 +1,660 @@
+/* -*- Mode: C; indent-tabs-mode: t; c-basic-offset: 4; tab-width: 4 -*- */
+/*
+ * copynes_uring.c
+ * Copyright (C) David Huseby 2009 <dave@linuxprogrammer.org>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with main.c; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor Boston, MA 02110-1301,  USA
+ */
+
+/*
+ * io_uring I/O engine for the data channel.
+ *
+ * A ring is shared by up to max_handles CopyNES handles.  It owns one
+ * registered buffer that is cut into a slot per handle; each slot has a 1K
+ * read area and a 2K write staging area.  Every handle keeps a read queued
+ * in the ring at all times, so while one handle waits for its data the
+ * completions of the others are reaped and their data sits in their slot
+ * until they ask for it.  Only one read per handle is ever queued because
+ * the data channel is a byte stream and two reads racing for it could
+ * complete out of order.
+ *
+ * Writes are copied into the staging area and queued.  Outside of a batch
+ * each write is submitted right away.  Writes queued inside a batch
+ * (copynes_uring_begin_batch/end_batch) are linked so they run in order and
+ * go out in one io_uring_enter when the batch ends.
+ *
+ * The ring is driven with the raw syscalls so liburing isn't needed.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <errno.h>
+#include <unistd.h>
+#include <termios.h>
+#include <pthread.h>
+#include <string.h>
+#include <sys/time.h>
+#include <sys/types.h>
+#include <sys/select.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <linux/io_uring.h>
+
+#include "copynes.h"
+#include "copynes_private.h"
+
+#define URING_READ_SIZE			KB(1)
+#define URING_WRITE_SIZE		KB(2)
+#define URING_SLOT_SIZE			(URING_READ_SIZE + URING_WRITE_SIZE)
+#define URING_SQES_PER_HANDLE	4
+#define URING_WRITE_TIMEOUT		1		/* seconds the device gets to take a write */
+#define URING_CANCEL_USEC		100000	/* how often a cancel is repeated */
+
+/* user_data is the handle pointer with the operation in the low bits */
+#define URING_TAG_READ			0
+#define URING_TAG_WRITE			1
+#define URING_TAG_CANCEL		2
+#define URING_TAG_MASK			3
+
+/* copynes_ring_wait woke up because of a cancel */
+#define URING_WAIT_CANCELLED	2
+
+struct copynes_ring_s
+{
+	int fd;
+	int max_handles;
+	uint8_t* slots;						/* which buffer slots are taken */
+	uint8_t* bufs;						/* the registered buffer */
+	size_t bufs_size;
+	unsigned int to_submit;
+
+	/* submission queue */
+	void* sq_ring;
+	size_t sq_ring_size;
+	unsigned int* sq_head;
+	unsigned int* sq_tail;
+	unsigned int* sq_mask;
+	unsigned int* sq_entries;
+	unsigned int* sq_array;
+	struct io_uring_sqe* sqes;
+	size_t sqes_size;
+
+	/* completion queue */
+	void* cq_ring;
+	size_t cq_ring_size;
+	unsigned int* cq_head;
+	unsigned int* cq_tail;
+	unsigned int* cq_mask;
+	struct io_uring_cqe* cqes;
+};
+
+
+static int sys_io_uring_setup(unsigned int entries, struct io_uring_params* p)
+{
+	return (int)syscall(__NR_io_uring_setup, entries, p);
+}
+
+
+static int sys_io_uring_enter(int fd, unsigned int to_submit, unsigned int min_complete, unsigned int flags)
+{
+	return (int)syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, 0, 0);
+}
+
+
+static int sys_io_uring_register(int fd, unsigned int opcode, void* arg, unsigned int nr_args)
+{
+	return (int)syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+
+copynes_ring_t copynes_ring_new(int max_handles)
+{
+	copynes_ring_t ring = 0;
+	struct io_uring_params p;
+	struct iovec iov;
+
+	if(max_handles <= 0)
+		return 0;
+
+	if((ring = calloc(1, sizeof(struct copynes_ring_s))) == 0)
+		return 0;
+
+	ring->fd = -1;
+	ring->max_handles = max_handles;
+	ring->sq_ring = MAP_FAILED;
+	ring->cq_ring = MAP_FAILED;
+	ring->sqes = MAP_FAILED;
+	ring->bufs = MAP_FAILED;
+
+	memset(&p, 0, sizeof(p));
+	if((ring->fd = sys_io_uring_setup(max_handles * URING_SQES_PER_HANDLE, &p)) < 0)
+		goto fail;
+
+	/* map the submission and completion rings */
+	ring->sq_ring_size = p.sq_off.array + (p.sq_entries * sizeof(unsigned int));
+	ring->cq_ring_size = p.cq_off.cqes + (p.cq_entries * sizeof(struct io_uring_cqe));
+	if(p.features & IORING_FEAT_SINGLE_MMAP)
+	{
+		if(ring->cq_ring_size > ring->sq_ring_size)
+			ring->sq_ring_size = ring->cq_ring_size;
+		ring->cq_ring_size = ring->sq_ring_size;
+	}
+
+	ring->sq_ring = mmap(0, ring->sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+	if(ring->sq_ring == MAP_FAILED)
+		goto fail;
+
+	if(p.features & IORING_FEAT_SINGLE_MMAP)
+		ring->cq_ring = ring->sq_ring;
+	else if((ring->cq_ring = mmap(0, ring->cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING)) == MAP_FAILED)
+		goto fail;
+
+	ring->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+	ring->sqes = mmap(0, ring->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+	if(ring->sqes == MAP_FAILED)
+		goto fail;
+
+	ring->sq_head = (unsigned int*)((uint8_t*)ring->sq_ring + p.sq_off.head);
+	ring->sq_tail = (unsigned int*)((uint8_t*)ring->sq_ring + p.sq_off.tail);
+	ring->sq_mask = (unsigned int*)((uint8_t*)ring->sq_ring + p.sq_off.ring_mask);
+	ring->sq_entries = (unsigned int*)((uint8_t*)ring->sq_ring + p.sq_off.ring_entries);
+	ring->sq_array = (unsigned int*)((uint8_t*)ring->sq_ring + p.sq_off.array);
+	ring->cq_head = (unsigned int*)((uint8_t*)ring->cq_ring + p.cq_off.head);
+	ring->cq_tail = (unsigned int*)((uint8_t*)ring->cq_ring + p.cq_off.tail);
+	ring->cq_mask = (unsigned int*)((uint8_t*)ring->cq_ring + p.cq_off.ring_mask);
+	ring->cqes = (struct io_uring_cqe*)((uint8_t*)ring->cq_ring + p.cq_off.cqes);
+
+	/* one registered buffer holds the slots of every handle */
+	ring->bufs_size = (size_t)max_handles * URING_SLOT_SIZE;
+	ring->bufs = mmap(0, ring->bufs_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if(ring->bufs == MAP_FAILED)
+		goto fail;
+
+	iov.iov_base = ring->bufs;
+	iov.iov_len = ring->bufs_size;
+	if(sys_io_uring_register(ring->fd, IORING_REGISTER_BUFFERS, &iov, 1) < 0)
+		goto fail;
+
+	if((ring->slots = calloc(max_handles, sizeof(uint8_t))) == 0)
+		goto fail;
+
+	return ring;
+
+fail:
+	copynes_ring_free(ring);
+	return 0;
+}
+
+
+void copynes_ring_free(copynes_ring_t ring)
+{
+	if(ring == 0)
+		return;
+
+	if(ring->bufs != MAP_FAILED)
+		munmap(ring->bufs, ring->bufs_size);
+	if(ring->sqes != MAP_FAILED)
+		munmap(ring->sqes, ring->sqes_size);
+	if((ring->cq_ring != MAP_FAILED) && (ring->cq_ring != ring->sq_ring))
+		munmap(ring->cq_ring, ring->cq_ring_size);
+	if(ring->sq_ring != MAP_FAILED)
+		munmap(ring->sq_ring, ring->sq_ring_size);
+	if(ring->fd >= 0)
+		close(ring->fd);
+
+	free(ring->slots);
+	free(ring);
+}
+
+
+/* submit everything that has been queued */
+static int copynes_ring_submit(copynes_ring_t ring)
+{
+	int ret = 0;
+
+	while(ring->to_submit > 0)
+	{
+		if((ret = sys_io_uring_enter(ring->fd, ring->to_submit, 0, 0)) < 0)
+		{
+			if(errno == EINTR)
+				continue;
+			return -1;
+		}
+		ring->to_submit -= ret;
+	}
+
+	return 0;
+}
+
+
+/* hand every completion to the handle it belongs to */
+static int copynes_ring_reap(copynes_ring_t ring)
+{
+	int reaped = 0;
+	unsigned int head = *ring->cq_head;
+	struct io_uring_cqe* cqe = 0;
+	copynes_t cn = 0;
+
+	while(head != __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE))
+	{
+		cqe = &ring->cqes[head & *ring->cq_mask];
+		cn = (copynes_t)(uintptr_t)(cqe->user_data & ~(uint64_t)URING_TAG_MASK);
+
+		switch(cqe->user_data & URING_TAG_MASK)
+		{
+			case URING_TAG_READ:
+			{
+				cn->uring.read_pending = 0;
+				cn->uring.read_off = 0;
+				if(cqe->res >= 0)
+					cn->uring.read_len = cqe->res;
+				else if(cqe->res != -ECANCELED)
+					cn->uring.read_res = cqe->res;
+				break;
+			}
+			case URING_TAG_WRITE:
+			{
+				/* a short write leaves a hole in the command stream */
+				if(cqe->res < 0)
+					cn->uring.write_err = 1;
+				if(--cn->uring.write_inflight == 0)
+					cn->uring.write_used = 0;
+				break;
+			}
+		}
+
+		head++;
+		reaped++;
+		__atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+	}
+
+	return reaped;
+}
+
+
+/* get a free sqe, submitting the queue if it is full */
+static struct io_uring_sqe* copynes_ring_get_sqe(copynes_ring_t ring)
+{
+	unsigned int tail = *ring->sq_tail;
+	unsigned int idx = 0;
+	struct io_uring_sqe* sqe = 0;
+
+	if((tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE)) >= *ring->sq_entries)
+	{
+		if(copynes_ring_submit(ring) < 0)
+			return 0;
+	}
+
+	idx = tail & *ring->sq_mask;
+	sqe = &ring->sqes[idx];
+	memset(sqe, 0, sizeof(*sqe));
+	ring->sq_array[idx] = idx;
+
+	__atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+	ring->to_submit++;
+
+	return sqe;
+}
+
+
+/* block until at least one completion shows up, then reap */
+static int copynes_ring_wait(copynes_ring_t ring, struct timeval *timeout, int cancel_fd)
+{
+	fd_set readfds;
+	int nfds = ring->fd;
+	int ret = 0;
+
+	if(copynes_ring_submit(ring) < 0)
+		return -1;
+
+	/* don't sleep on completions that are already here */
+	if(copynes_ring_reap(ring) > 0)
+		return 1;
+
+	FD_ZERO(&readfds);
+	FD_SET(ring->fd, &readfds);
+	if(cancel_fd >= 0)
+	{
+		FD_SET(cancel_fd, &readfds);
+		if(cancel_fd > nfds)
+			nfds = cancel_fd;
+	}
+
+	/* the ring fd polls readable while the completion queue isn't empty */
+	if((ret = select(nfds + 1, &readfds, 0, 0, timeout)) < 0)
+		return (errno == EINTR) ? 0 : -1;
+
+	copynes_ring_reap(ring);
+
+	if((ret > 0) && (cancel_fd >= 0) && FD_ISSET(cancel_fd, &readfds))
+		return URING_WAIT_CANCELLED;
+
+	return ret;
+}
+
+
+/* wait until every write of this handle has completed.  gives up with
+   -FAILED_DATA_WRITE after URING_WRITE_TIMEOUT (flow control holding the
+   line) or -FAILED_CANCELLED; writes still in flight keep the staging area
+   busy, so the next write waits for them again */
+static int copynes_uring_drain_writes(copynes_t cn)
+{
+	copynes_ring_t ring = cn->uring.ring;
+	struct timeval t = { URING_WRITE_TIMEOUT, 0L };
+	int ret = 0;
+
+	cn->uring.write_inflight += cn->uring.write_queued;
+	cn->uring.write_queued = 0;
+
+	while(cn->uring.write_inflight > 0)
+	{
+		/* check to see if we've run out of time */
+		if((t.tv_sec <= 0) && (t.tv_usec <= 0))
+			return -FAILED_DATA_WRITE;
+
+		if((ret = copynes_ring_wait(ring, &t, (cn->cancel != 0) ? cn->cancel->rfd : -1)) < 0)
+			return -FAILED_DATA_WRITE;
+
+		if(ret == URING_WAIT_CANCELLED)
+			return -FAILED_CANCELLED;
+	}
+
+	return 0;
+}
+
+
+/* cancel this handle's operations with the given tag and wait for them to
+   come back, so the ring never hands a completion to a freed handle.  the
+   cancel is repeated since each one only hits a single operation */
+static void copynes_uring_cancel(copynes_t cn, int tag, int* pending)
+{
+	copynes_ring_t ring = cn->uring.ring;
+	struct io_uring_sqe* sqe = 0;
+	struct timeval t;
+
+	while(*pending > 0)
+	{
+		if((sqe = copynes_ring_get_sqe(ring)) != 0)
+		{
+			sqe->opcode = IORING_OP_ASYNC_CANCEL;
+			sqe->addr = (uint64_t)(uintptr_t)cn | tag;
+			sqe->user_data = (uint64_t)(uintptr_t)cn | URING_TAG_CANCEL;
+		}
+
+		t.tv_sec = 0;
+		t.tv_usec = URING_CANCEL_USEC;
+		if(copynes_ring_wait(ring, &t, -1) < 0)
+			break;
+	}
+}
+
+
+int copynes_uring_attach(copynes_t cn, copynes_ring_t ring)
+{
+	int i = 0;
+
+	/* no shared ring, make a private one */
+	if(ring == 0)
+	{
+		if((ring = copynes_ring_new(1)) == 0)
+			return -1;
+		cn->uring.owned = 1;
+	}
+
+	/* claim a buffer slot */
+	for(i = 0; i < ring->max_handles; i++)
+	{
+		if(!ring->slots[i])
+			break;
+	}
+
+	if(i == ring->max_handles)
+	{
+		if(cn->uring.owned)
+			copynes_ring_free(ring);
+		cn->uring.owned = 0;
+		return -1;
+	}
+
+	ring->slots[i] = 1;
+	cn->uring.ring = ring;
+	cn->uring.slot = i;
+	cn->uring.rbuf = ring->bufs + ((size_t)i * URING_SLOT_SIZE);
+	cn->uring.wbuf = cn->uring.rbuf + URING_READ_SIZE;
+
+	return 0;
+}
+
+
+void copynes_uring_detach(copynes_t cn)
+{
+	copynes_ring_t ring = cn->uring.ring;
+
+	if(ring == 0)
+		return;
+
+	/* let queued writes finish, unless the device won't take them or the
+	   handle was cancelled */
+	if(copynes_uring_drain_writes(cn) < 0)
+		copynes_uring_cancel(cn, URING_TAG_WRITE, &cn->uring.write_inflight);
+
+	/* nobody is waiting for the outstanding read anymore */
+	copynes_uring_cancel(cn, URING_TAG_READ, &cn->uring.read_pending);
+
+	/* the cancel completion itself may still be in the queue */
+	copynes_ring_submit(ring);
+	copynes_ring_reap(ring);
+
+	ring->slots[cn->uring.slot] = 0;
+	if(cn->uring.owned)
+		copynes_ring_free(ring);
+
+	memset(&cn->uring, 0, sizeof(cn->uring));
+}
+
+
+/* throw away what was read so far.  a read still in the ring may complete
+   with data from before the flush, so it is cancelled and reaped first */
+void copynes_uring_flush(copynes_t cn)
+{
+	if(cn->uring.ring == 0)
+		return;
+
+	copynes_uring_cancel(cn, URING_TAG_READ, &cn->uring.read_pending);
+
+	cn->uring.read_off = 0;
+	cn->uring.read_len = 0;
+	cn->uring.read_res = 0;
+}
+
+
+ssize_t copynes_uring_read(copynes_t cn, void* buf, size_t count, struct timeval *timeout)
+{
+	copynes_ring_t ring = cn->uring.ring;
+	struct io_uring_sqe* sqe = 0;
+	size_t i = 0;
+	size_t n = 0;
+	int ret = 0;
+
+	while(i < count)
+	{
+		/* hand out what the last completion brought in */
+		if(cn->uring.read_len > 0)
+		{
+			n = ((size_t)cn->uring.read_len < (count - i)) ? (size_t)cn->uring.read_len : (count - i);
+			memcpy((uint8_t*)buf + i, cn->uring.rbuf + cn->uring.read_off, n);
+			cn->uring.read_off += n;
+			cn->uring.read_len -= n;
+			i += n;
+			continue;
+		}
+
+		if(cn->uring.read_res < 0)
+		{
+			cn->uring.read_res = 0;
+			cn->err = FAILED_DATA_READ;
+			return -cn->err;
+		}
+
+		/* check to see if we've run out of time */
+		if((timeout != 0) && (timeout->tv_sec <= 0) && (timeout->tv_usec <= 0))
+			break;
+
+		/* keep a read queued into our slot */
+		if(!cn->uring.read_pending)
+		{
+			if((sqe = copynes_ring_get_sqe(ring)) == 0)
+			{
+				cn->err = FAILED_DATA_READ;
+				return -cn->err;
+			}
+			sqe->opcode = IORING_OP_READ_FIXED;
+			sqe->fd = cn->data;
+			sqe->addr = (uint64_t)(uintptr_t)cn->uring.rbuf;
+			sqe->len = URING_READ_SIZE;
+			sqe->off = (uint64_t)-1;
+			sqe->buf_index = 0;
+			sqe->user_data = (uint64_t)(uintptr_t)cn | URING_TAG_READ;
+			cn->uring.read_pending = 1;
+		}
+
+		/* wait for our read, anybody else's completion or a cancel */
+		if((ret = copynes_ring_wait(ring, timeout, (cn->cancel != 0) ? cn->cancel->rfd : -1)) < 0)
+		{
+			cn->err = FAILED_DATA_READ;
+			return -cn->err;
+		}
+
+		/* the queued read stays in the ring and is picked up next time */
+		if(ret == URING_WAIT_CANCELLED)
+		{
+			cn->err = FAILED_CANCELLED;
+			return -cn->err;
+		}
+	}
+
+	return (ssize_t)i;
+}
+
+
+ssize_t copynes_uring_write(copynes_t cn, void* buf, size_t size)
+{
+	copynes_ring_t ring = cn->uring.ring;
+	struct io_uring_sqe* sqe = 0;
+	ssize_t ret = 0;
+
+	/* report a failure from an earlier queued write */
+	if(cn->uring.write_err)
+	{
+		cn->uring.write_err = 0;
+		cn->err = FAILED_DATA_WRITE;
+		return -cn->err;
+	}
+
+	/* only one submission's worth of writes may be in flight at a time,
+	   writes from separate submissions could run out of order */
+	if((cn->uring.write_inflight > 0) ||
+	   ((cn->uring.write_used + size) > URING_WRITE_SIZE))
+	{
+		if((ret = copynes_uring_drain_writes(cn)) < 0)
+		{
+			cn->err = -ret;
+			return -cn->err;
+		}
+		cn->uring.write_used = 0;
+	}
+
+	/* too big for the staging area, write it directly */
+	if(size > URING_WRITE_SIZE)
+	{
+		if((ret = write(cn->data, buf, size)) < 0)
+		{
+			cn->err = FAILED_DATA_WRITE;
+			return -cn->err;
+		}
+		return ret;
+	}
+
+	if((sqe = copynes_ring_get_sqe(ring)) == 0)
+	{
+		cn->err = FAILED_DATA_WRITE;
+		return -cn->err;
+	}
+
+	/* link to the previous write of this batch so they run in order */
+	if(cn->uring.write_queued > 0)
+		((struct io_uring_sqe*)cn->uring.last_write)->flags |= IOSQE_IO_LINK;
+	cn->uring.last_write = sqe;
+
+	memcpy(cn->uring.wbuf + cn->uring.write_used, buf, size);
+	sqe->opcode = IORING_OP_WRITE_FIXED;
+	sqe->fd = cn->data;
+	sqe->addr = (uint64_t)(uintptr_t)(cn->uring.wbuf + cn->uring.write_used);
+	sqe->len = size;
+	sqe->off = (uint64_t)-1;
+	sqe->buf_index = 0;
+	sqe->user_data = (uint64_t)(uintptr_t)cn | URING_TAG_WRITE;
+
+	cn->uring.write_used += size;
+	cn->uring.write_queued++;
+
+	if(!cn->uring.batching)
+	{
+		cn->uring.write_inflight += cn->uring.write_queued;
+		cn->uring.write_queued = 0;
+		if(copynes_ring_submit(ring) < 0)
+		{
+			cn->err = FAILED_DATA_WRITE;
+			return -cn->err;
+		}
+	}
+
+	return (ssize_t)size;
+}
+
+
+void copynes_uring_begin_batch(copynes_t cn)
+{
+	cn->uring.batching++;
+}
+
+
+int copynes_uring_end_batch(copynes_t cn)
+{
+	int ret = 0;
+
+	if((cn->uring.batching > 0) && (--cn->uring.batching > 0))
+		return 0;
+
+	/* the batch has to be on the wire before the caller moves on */
+	if((ret = copynes_uring_drain_writes(cn)) < 0)
+	{
+		cn->err = -ret;
+		return -cn->err;
+	}
+
+	if(cn->uring.write_err)
+	{
+		cn->uring.write_err = 0;
+		cn->err = FAILED_DATA_WRITE;
+		return -cn->err;
+	}
+
+	return 0;
+}
@@ -0,0 +1,408 @@
+/* -*- Mode: C; indent-tabs-mode: t; c-basic-offset: 4; tab-width: 4 -*- */
+/*
+ * copynes_wram.c
+ * Copyright (C) David Huseby 2009 <dave@linuxprogrammer.org>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with main.c; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor Boston, MA 02110-1301,  USA
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <limits.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <termios.h>
+#include <pthread.h>
+#include <arpa/inet.h>
+#include <sys/time.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/select.h>
+
+#include "copynes.h"
+#include "copynes_private.h"
+#include "copynes_wram.h"
+
+#define WRAM_MIN_PAGE_SIZE		64
+#define WRAM_MAX_PAGE_SIZE		65536
+#define WRAM_MANIFEST_HDR		17
+
+struct copynes_wram_s
+{
+	char dir[PATH_MAX];
+	int page_size;
+};
+
+/* a manifest read back from disk */
+struct wram_manifest_s
+{
+	uint32_t page_size;
+	uint32_t size;
+	uint32_t count;
+	uint8_t* hashes;					/* count * WRAM_HASH_SIZE */
+};
+
+
+/* snapshot names end up as file names */
+static int wram_valid_name(const char* name)
+{
+	return (name != 0) && (name[0] != '\0') && (name[0] != '.') && (strchr(name, '/') == 0);
+}
+
+
+static void wram_page_path(copynes_wram_t store, const uint8_t* hash, char* path, size_t size)
+{
+	static const char hex[] = "0123456789abcdef";
+	char name[WRAM_HASH_SIZE * 2 + 1];
+	int i = 0;
+
+	for(i = 0; i < WRAM_HASH_SIZE; i++)
+	{
+		name[i * 2] = hex[hash[i] >> 4];
+		name[i * 2 + 1] = hex[hash[i] & 0x0f];
+	}
+	name[WRAM_HASH_SIZE * 2] = '\0';
+
+	snprintf(path, size, "%s/pages/%.2s/%s", store->dir, name, &name[2]);
+}
+
+
+static int wram_mkdir(const char* path)
+{
+	if((mkdir(path, 0755) < 0) && (errno != EEXIST))
+		return -1;
+
+	return 0;
+}
+
+
+/* make a rename or new file in the directory holding path durable */
+static int wram_sync_dir(const char* path)
+{
+	char dir[PATH_MAX];
+	char* slash = 0;
+	int fd = -1;
+	int ret = 0;
+
+	snprintf(dir, sizeof(dir), "%s", path);
+	if((slash = strrchr(dir, '/')) == 0)
+		strcpy(dir, ".");
+	else
+		*slash = '\0';
+
+	if((fd = open(dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC)) < 0)
+		return -1;
+
+	ret = fsync(fd);
+	close(fd);
+
+	return ret;
+}
+
+
+/* write a file under a temporary name, get it on disk and move it into
+   place, so a crash never leaves a torn page or manifest behind.  the dump
+   cache stores its entries the same way */
+int copynes_write_file(const char* path, const uint8_t* hdr, size_t hdr_size, const uint8_t* data, size_t size)
+{
+	char tmp[PATH_MAX + 32];
+	FILE* f = 0;
+	int err = 0;
+	int n = 0;
+
+	n = snprintf(tmp, sizeof(tmp), "%s.tmp.%d", path, (int)getpid());
+	if((n < 0) || ((size_t)n >= sizeof(tmp)) || ((f = fopen(tmp, "wb")) == 0))
+		return -1;
+
+	if((hdr_size > 0) && (fwrite(hdr, hdr_size, 1, f) != 1))
+		err = 1;
+	if(!err && (size > 0) && (fwrite(data, size, 1, f) != 1))
+		err = 1;
+
+	/* the data has to be on disk before the rename can point at it */
+	if(!err && ((fflush(f) != 0) || (fsync(fileno(f)) < 0)))
+		err = 1;
+	if(fclose(f) != 0)
+		err = 1;
+
+	if(err || (rename(tmp, path) < 0))
+	{
+		unlink(tmp);
+		return -1;
+	}
+
+	/* and the rename itself has to survive too */
+	return wram_sync_dir(path);
+}
+
+
+static int wram_read_manifest(copynes_wram_t store, const char* name, struct wram_manifest_s* m)
+{
+	char path[PATH_MAX + 16];
+	uint8_t hdr[WRAM_MANIFEST_HDR];
+	uint32_t v = 0;
+	FILE* f = 0;
+
+	memset(m, 0, sizeof(*m));
+
+	if(!wram_valid_name(name))
+		return -1;
+
+	snprintf(path, sizeof(path), "%s/snapshots/%s", store->dir, name);
+	if((f = fopen(path, "rb")) == 0)
+		return -1;
+
+	if((fread(hdr, sizeof(hdr), 1, f) != 1) ||
+	   (memcmp(hdr, "CNWS", 4) != 0) || (hdr[4] != WRAM_VERSION))
+	{
+		fclose(f);
+		return -1;
+	}
+
+	memcpy(&v, &hdr[5], 4);
+	m->page_size = ntohl(v);
+	memcpy(&v, &hdr[9], 4);
+	m->size = ntohl(v);
+	memcpy(&v, &hdr[13], 4);
+	m->count = ntohl(v);
+
+	if((m->page_size == 0) ||
+	   (m->count != (m->size + m->page_size - 1) / m->page_size))
+	{
+		fclose(f);
+		return -1;
+	}
+
+	if((m->count > 0) &&
+	   (((m->hashes = malloc((size_t)m->count * WRAM_HASH_SIZE)) == 0) ||
+		(fread(m->hashes, (size_t)m->count * WRAM_HASH_SIZE, 1, f) != 1)))
+	{
+		free(m->hashes);
+		m->hashes = 0;
+		fclose(f);
+		return -1;
+	}
+
+	fclose(f);
+
+	return 0;
+}
+
+
+copynes_wram_t copynes_wram_open(const char* dir, int page_size)
+{
+	copynes_wram_t store = 0;
+	char path[PATH_MAX + 16];
+
+	if(page_size == 0)
+		page_size = WRAM_PAGE_SIZE;
+
+	if((dir == 0) || (strlen(dir) >= PATH_MAX) ||
+	   (page_size < WRAM_MIN_PAGE_SIZE) || (page_size > WRAM_MAX_PAGE_SIZE) ||
+	   (page_size & (page_size - 1)))
+		return 0;
+
+	if(wram_mkdir(dir) < 0)
+		return 0;
+	snprintf(path, sizeof(path), "%s/pages", dir);
+	if(wram_mkdir(path) < 0)
+		return 0;
+	snprintf(path, sizeof(path), "%s/snapshots", dir);
+	if(wram_mkdir(path) < 0)
+		return 0;
+
+	if((store = calloc(1, sizeof(struct copynes_wram_s))) == 0)
+		return 0;
+
+	strcpy(store->dir, dir);
+	store->page_size = page_size;
+
+	return store;
+}
+
+
+void copynes_wram_close(copynes_wram_t store)
+{
+	free(store);
+}
+
+
+int copynes_wram_save(copynes_wram_t store, const char* name, copynes_packet_t pkt)
+{
+	char path[PATH_MAX + 96];
+	uint8_t hdr[WRAM_MANIFEST_HDR] = { 'C', 'N', 'W', 'S', WRAM_VERSION };
+	uint8_t* hashes = 0;
+	struct stat st;
+	uint32_t count = 0;
+	uint32_t v = 0;
+	size_t off = 0;
+	size_t len = 0;
+	uint32_t i = 0;
+	int added = 0;
+
+	if((store == 0) || !wram_valid_name(name) || (pkt == 0) ||
+	   (pkt->type != PACKET_WRAM) || (pkt->size < 0) || ((pkt->size > 0) && (pkt->data == 0)))
+		return -1;
+
+	count = (pkt->size + store->page_size - 1) / store->page_size;
+	if((count > 0) && ((hashes = malloc((size_t)count * WRAM_HASH_SIZE)) == 0))
+		return -1;
+
+	for(i = 0; i < count; i++)
+	{
+		off = (size_t)i * store->page_size;
+		len = ((pkt->size - off) > (size_t)store->page_size) ? (size_t)store->page_size : (pkt->size - off);
+
+		copynes_sha256(&pkt->data[off], len, &hashes[i * WRAM_HASH_SIZE]);
+
+		/* a page already in the store is never written again */
+		wram_page_path(store, &hashes[i * WRAM_HASH_SIZE], path, sizeof(path));
+		if(stat(path, &st) == 0)
+			continue;
+
+		*strrchr(path, '/') = '\0';
+		if(wram_mkdir(path) < 0)
+			goto fail;
+		path[strlen(path)] = '/';
+
+		if(copynes_write_file(path, 0, 0, &pkt->data[off], len) < 0)
+			goto fail;
+		added++;
+	}
+
+	v = htonl(store->page_size);
+	memcpy(&hdr[5], &v, 4);
+	v = htonl(pkt->size);
+	memcpy(&hdr[9], &v, 4);
+	v = htonl(count);
+	memcpy(&hdr[13], &v, 4);
+
+	/* the manifest goes last so it never names a missing page */
+	snprintf(path, sizeof(path), "%s/snapshots/%s", store->dir, name);
+	if(copynes_write_file(path, hdr, sizeof(hdr), hashes, (size_t)count * WRAM_HASH_SIZE) < 0)
+		goto fail;
+
+	free(hashes);
+
+	return added;
+
+fail:
+	free(hashes);
+	return -1;
+}
+
+
+ssize_t copynes_wram_restore(copynes_wram_t store, const char* name, uint8_t* buf, size_t size)
+{
+	struct wram_manifest_s m;
+	char path[PATH_MAX + 96];
+	uint8_t check[WRAM_HASH_SIZE];
+	size_t off = 0;
+	size_t len = 0;
+	uint32_t i = 0;
+	FILE* f = 0;
+	int err = 0;
+
+	if((store == 0) || (wram_read_manifest(store, name, &m) < 0))
+		return -1;
+
+	if(buf == 0)
+	{
+		free(m.hashes);
+		return (ssize_t)m.size;
+	}
+
+	if(size < m.size)
+	{
+		free(m.hashes);
+		return -1;
+	}
+
+	for(i = 0; (i < m.count) && !err; i++)
+	{
+		off = (size_t)i * m.page_size;
+		len = ((m.size - off) > m.page_size) ? m.page_size : (m.size - off);
+
+		wram_page_path(store, &m.hashes[i * WRAM_HASH_SIZE], path, sizeof(path));
+		if((f = fopen(path, "rb")) == 0)
+		{
+			err = 1;
+			break;
+		}
+		if(fread(&buf[off], len, 1, f) != 1)
+			err = 1;
+		fclose(f);
+
+		/* don't hand back a page that rotted on disk */
+		if(!err)
+		{
+			copynes_sha256(&buf[off], len, check);
+			if(memcmp(check, &m.hashes[i * WRAM_HASH_SIZE], WRAM_HASH_SIZE) != 0)
+				err = 1;
+		}
+	}
+
+	free(m.hashes);
+
+	return err ? -1 : (ssize_t)m.size;
+}
+
+
+int copynes_wram_diff(copynes_wram_t store, const char* a, const char* b, int* pages, int max)
+{
+	struct wram_manifest_s ma;
+	struct wram_manifest_s mb;
+	uint32_t count = 0;
+	uint32_t i = 0;
+	int ndiff = 0;
+
+	if(store == 0)
+		return -1;
+
+	if(wram_read_manifest(store, a, &ma) < 0)
+		return -1;
+	if(wram_read_manifest(store, b, &mb) < 0)
+	{
+		free(ma.hashes);
+		return -1;
+	}
+
+	if(ma.page_size != mb.page_size)
+	{
+		free(ma.hashes);
+		free(mb.hashes);
+		return -1;
+	}
+
+	count = (ma.count > mb.count) ? ma.count : mb.count;
+	for(i = 0; i < count; i++)
+	{
+		if((i < ma.count) && (i < mb.count) &&
+		   (memcmp(&ma.hashes[i * WRAM_HASH_SIZE], &mb.hashes[i * WRAM_HASH_SIZE], WRAM_HASH_SIZE) == 0))
+			continue;
+
+		if((pages != 0) && (ndiff < max))
+			pages[ndiff] = (int)i;
+		ndiff++;
+	}
+
+	free(ma.hashes);
+	free(mb.hashes);
+
+	return ndiff;
+}
@@ -0,0 +1,72 @@
+/* -*- Mode: C; indent-tabs-mode: t; c-basic-offset: 4; tab-width: 4 -*- */
+/*
+ * copynes_wram.h
+ * Copyright (C) David Huseby 2009 <dave@linuxprogrammer.org>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with main.c; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor Boston, MA 02110-1301,  USA
+ */
+
+/*
+ * WRAM snapshots.  Save RAM is cut into fixed size pages and every page is
+ * stored once, under its SHA-256, no matter how many snapshots use it.  A
+ * snapshot is just a manifest listing its pages, so backing up a save that
+ * barely changed only writes the changed pages and a small manifest.
+ *
+ * Store layout:
+ *
+ *   <dir>/pages/<first 2 hex digits>/<remaining 62 hex digits>
+ *   <dir>/snapshots/<name>
+ *
+ * Manifest layout, all integers big endian:
+ *
+ *   "CNWS" version(1) page size(4) data size(4) page count(4)
+ *   SHA-256 of each page(32 each)
+ *
+ * The last page is short when the data size isn't a multiple of the page
+ * size.
+ */
+
+#ifndef __LIBCOPYNES_WRAM__
+#define __LIBCOPYNES_WRAM__
+
+#define WRAM_VERSION			1
+#define WRAM_PAGE_SIZE			1024	/* default page size */
+#define WRAM_HASH_SIZE			32
+
+typedef struct copynes_wram_s *copynes_wram_t;
+
+/* open a snapshot store, creating the directories if needed.  page_size
+   must be a power of two from 64 to 65536, or 0 for WRAM_PAGE_SIZE; it
+   only affects new snapshots */
+copynes_wram_t copynes_wram_open(const char* dir, int page_size);
+
+void copynes_wram_close(copynes_wram_t store);
+
+/* store a PACKET_WRAM packet as snapshot name, replacing any snapshot of
+   the same name.  returns the number of pages that weren't in the store
+   yet or -1 on error */
+int copynes_wram_save(copynes_wram_t store, const char* name, copynes_packet_t pkt);
+
+/* put a snapshot back together in buf, returns its size or -1.  with buf 0
+   only the size is returned */
+ssize_t copynes_wram_restore(copynes_wram_t store, const char* name, uint8_t* buf, size_t size);
+
+/* compare two snapshots page by page without reading any pages.  returns
+   the number of pages that differ (pages only one snapshot has count as
+   different) and stores up to max of their indices in pages, or -1 if a
+   snapshot can't be read or they use different page sizes */
+int copynes_wram_diff(copynes_wram_t store, const char* a, const char* b, int* pages, int max);
+
+#endif
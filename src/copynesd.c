@@ -0,0 +1,535 @@
+/* -*- Mode: C; indent-tabs-mode: t; c-basic-offset: 4; tab-width: 4 -*- */
+/*
+ * copynesd.c
+ * Copyright (C) David Huseby 2009 <dave@linuxprogrammer.org>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with main.c; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor Boston, MA 02110-1301,  USA
+ */
+
+/*
+ * copynesd keeps a single CopyNES open and configured and serves requests
+ * from local clients over a SOCK_SEQPACKET unix socket.  Every request and
+ * every reply is exactly one message of text:
+ *
+ *   version                       -> ok <version string>
+ *   nes                           -> ok <1 if the NES is on, 0 if not>
+ *   reset <mode>                  -> ok
+ *   dump <timeout secs> <plugin>  -> ok <mirroring> [<type> <offset> <size>]...
+ *
+ * A failed request is answered with "err <error string>".  The reply to a
+ * dump also carries a memfd (SCM_RIGHTS) holding the packet data back to
+ * back, the offsets and sizes in the reply describe where each packet is.
+ * The packets are read straight into the memfd, a dump can't be bigger
+ * than MAX_DUMP.  Plugins are read from disk once and kept in memory for
+ * as long as the file doesn't change.
+ * Replies are never longer than MAX_MESSAGE, a dump with more packets than
+ * fit is answered with an error.
+ *
+ * Run one copynesd per CopyNES.  Any number of clients (up to MAX_CLIENTS)
+ * can stay connected; their requests are handled one at a time so they
+ * never fight over the tty, and an idle client doesn't hold up the others.
+ * A client that doesn't take its reply is dropped.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+#include <string.h>
+#include <poll.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <sys/time.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "copynes.h"
+
+#define DEFAULT_SOCKET_PATH		"/run/copynesd.sock"
+#define MAX_MESSAGE				1024
+#define MAX_VERSION				256
+#define MAX_CLIENTS				16
+#define MAX_PLUGINS				16
+#define MAX_PLUGIN_SIZE			(128 + 1024)
+#define MAX_DUMP				(32 * 1024 * 1024)
+
+/* a plugin .bin kept in memory, valid while the file is unchanged */
+struct copynesd_plugin_s
+{
+	char path[PATH_MAX];
+	dev_t dev;
+	ino_t ino;
+	off_t size;
+	struct timespec ctime;			/* changes with any write, unlike mtime */
+	unsigned long used;				/* for evicting the least recently used */
+	uint8_t image[MAX_PLUGIN_SIZE];
+};
+
+/* daemon state */
+struct copynesd_s
+{
+	copynes_t cn;
+	int listener;
+	const char* socket_path;
+	char version[MAX_VERSION];		/* cached once the CopyNES answers */
+	unsigned long uses;
+	struct copynesd_plugin_s plugins[MAX_PLUGINS];
+};
+
+static volatile sig_atomic_t running = 1;
+static copynes_cancel_t shutdown_cancel = 0;
+
+static void copynesd_signal(int sig)
+{
+	(void)sig;
+	running = 0;
+
+	/* don't make shutdown wait for a dump in progress */
+	if(shutdown_cancel != 0)
+		copynes_cancel(shutdown_cancel);
+}
+
+
+/* send a single reply message, optionally handing an fd to the client */
+static int copynesd_reply(int client, const char* msg, int fd)
+{
+	struct msghdr mh;
+	struct iovec iov;
+	struct cmsghdr* cmsg;
+	union
+	{
+		struct cmsghdr align;
+		char buf[CMSG_SPACE(sizeof(int))];
+	} control;
+
+	memset(&mh, 0, sizeof(mh));
+	iov.iov_base = (void*)msg;
+	iov.iov_len = strlen(msg);
+	mh.msg_iov = &iov;
+	mh.msg_iovlen = 1;
+
+	if(fd >= 0)
+	{
+		/* attach the fd as ancillary data */
+		memset(&control, 0, sizeof(control));
+		mh.msg_control = control.buf;
+		mh.msg_controllen = sizeof(control.buf);
+		cmsg = CMSG_FIRSTHDR(&mh);
+		cmsg->cmsg_level = SOL_SOCKET;
+		cmsg->cmsg_type = SCM_RIGHTS;
+		cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+		memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+	}
+
+	/* never block the other clients on one that isn't reading */
+	return (sendmsg(client, &mh, MSG_NOSIGNAL | MSG_DONTWAIT) < 0) ? -1 : 0;
+}
+
+
+static int copynesd_reply_error(struct copynesd_s* d, int client)
+{
+	char msg[MAX_MESSAGE];
+
+	snprintf(msg, sizeof(msg), "err %s", copynes_error_string(d->cn));
+	return copynesd_reply(client, msg, -1);
+}
+
+
+static int copynesd_version(struct copynesd_s* d, int client)
+{
+	char msg[MAX_MESSAGE];
+	ssize_t ret = 0;
+
+	/* the version string never changes, only ask the CopyNES once */
+	if(d->version[0] == '\0')
+	{
+		if((ret = copynes_get_version(d->cn, d->version, MAX_VERSION - 1)) < 0)
+		{
+			d->version[0] = '\0';
+			return copynesd_reply_error(d, client);
+		}
+		d->version[ret] = '\0';
+	}
+
+	snprintf(msg, sizeof(msg), "ok %s", d->version);
+	return copynesd_reply(client, msg, -1);
+}
+
+
+static int copynesd_reset(struct copynesd_s* d, int client, const char* args)
+{
+	int mode = RESET_COPYMODE;
+
+	if(args != 0)
+		mode = atoi(args);
+
+	if(copynes_reset(d->cn, mode) < 0)
+		return copynesd_reply_error(d, client);
+
+	return copynesd_reply(client, "ok", -1);
+}
+
+
+/* load a plugin from the cache, reading it in first if it isn't there or
+   the file changed since */
+static int copynesd_load_plugin(struct copynesd_s* d, const char* path)
+{
+	struct copynesd_plugin_s* p = 0;
+	struct stat st;
+	ssize_t n = 0;
+	int fd = -1;
+	int i = 0;
+
+	if(strlen(path) >= PATH_MAX)
+		return copynes_load_plugin(d->cn, path);
+
+	if(stat(path, &st) < 0)
+		return copynes_load_plugin(d->cn, path);
+
+	/* look it up, otherwise take an empty or the least recently used slot */
+	for(i = 0; i < MAX_PLUGINS; i++)
+	{
+		if(strcmp(d->plugins[i].path, path) == 0)
+		{
+			p = &d->plugins[i];
+			break;
+		}
+		if((p == 0) || (d->plugins[i].used < p->used))
+			p = &d->plugins[i];
+	}
+
+	if((strcmp(p->path, path) != 0) || (p->dev != st.st_dev) || (p->ino != st.st_ino) ||
+	   (p->size != st.st_size) || (p->ctime.tv_sec != st.st_ctim.tv_sec) ||
+	   (p->ctime.tv_nsec != st.st_ctim.tv_nsec))
+	{
+		p->path[0] = '\0';
+
+		/* let the library report a missing or unreadable plugin */
+		if((fd = open(path, O_RDONLY | O_CLOEXEC)) < 0)
+			return copynes_load_plugin(d->cn, path);
+		n = read(fd, p->image, MAX_PLUGIN_SIZE);
+		close(fd);
+		if(n <= 0)
+			return copynes_load_plugin(d->cn, path);
+
+		memset(p->image + n, 0, MAX_PLUGIN_SIZE - n);
+		strcpy(p->path, path);
+		p->dev = st.st_dev;
+		p->ino = st.st_ino;
+		p->size = st.st_size;
+		p->ctime = st.st_ctim;
+	}
+
+	p->used = ++d->uses;
+
+	return copynes_load_plugin_image(d->cn, p->image, MAX_PLUGIN_SIZE);
+}
+
+
+static int copynesd_dump(struct copynesd_s* d, int client, char* args)
+{
+	char msg[MAX_MESSAGE];
+	char* plugin = 0;
+	uint8_t* map = MAP_FAILED;
+	int fd = -1;
+	int ret = 0;
+	int n = 0;
+	int full = 0;
+	size_t len = 0;
+	off_t offset = 0;
+	uint8_t mirroring = 0;
+	struct copynes_packet_s pkt;
+	struct timeval timeout = { 0L, 0L };
+	struct timeval t = { 1L, 0L };
+
+	/* parse "<timeout secs> <plugin>" */
+	if((args == 0) || ((plugin = strchr(args, ' ')) == 0))
+		return copynesd_reply(client, "err usage: dump <timeout secs> <plugin>", -1);
+	*plugin++ = '\0';
+	timeout.tv_sec = atol(args);
+
+	/* put the CopyNES in copy mode and start the plugin */
+	if((copynes_reset(d->cn, RESET_COPYMODE) < 0) ||
+	   (copynesd_load_plugin(d, plugin) < 0) ||
+	   (copynes_run_plugin(d->cn) < 0))
+	{
+		return copynesd_reply_error(d, client);
+	}
+
+	/* the plugin sends the mirroring byte before any packets */
+	if(copynes_read(d->cn, &mirroring, sizeof(uint8_t), &t) != sizeof(uint8_t))
+		return copynesd_reply(client, "err failed to read mirroring", -1);
+
+	/* the packets go straight into the memfd, only the pages written to
+	   are ever allocated */
+	if((fd = memfd_create("copynesd-dump", MFD_CLOEXEC)) < 0)
+		return copynesd_reply(client, "err failed to create memfd", -1);
+
+	if((ftruncate(fd, MAX_DUMP) < 0) ||
+	   ((map = mmap(0, MAX_DUMP, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0)) == MAP_FAILED))
+	{
+		close(fd);
+		return copynesd_reply(client, "err failed to map memfd", -1);
+	}
+
+	len = snprintf(msg, sizeof(msg), "ok %d", mirroring);
+
+	/* read packets until the plugin says it's done */
+	while(1)
+	{
+		if(copynes_read_packet_buf(d->cn, &pkt, map + offset, MAX_DUMP - offset, timeout) < 0)
+		{
+			munmap(map, MAX_DUMP);
+			close(fd);
+			return copynesd_reply_error(d, client);
+		}
+
+		if(pkt.type == PACKET_EOD)
+			break;
+
+		if(pkt.size > 0)
+		{
+			/* a cut off entry would lie, let the plugin finish and fail */
+			n = full ? 0 : snprintf(msg + len, sizeof(msg) - len, " %d %ld %d", pkt.type, (long)offset, pkt.size);
+			if((n < 0) || ((size_t)n >= (sizeof(msg) - len)))
+				full = 1;
+			else
+				len += n;
+			offset += pkt.size;
+		}
+	}
+
+	/* hand over just the data */
+	munmap(map, MAX_DUMP);
+	if(ftruncate(fd, offset) < 0)
+		ret = copynesd_reply(client, "err failed to size memfd", -1);
+	else if(full)
+		ret = copynesd_reply(client, "err too many packets for the reply", -1);
+	else
+		ret = copynesd_reply(client, msg, fd);
+	close(fd);
+
+	return ret;
+}
+
+
+/* handle one request message */
+static int copynesd_handle(struct copynesd_s* d, int client, char* req)
+{
+	char* args = strchr(req, ' ');
+
+	if(args != 0)
+		*args++ = '\0';
+
+	if(strcmp(req, "version") == 0)
+		return copynesd_version(d, client);
+	if(strcmp(req, "nes") == 0)
+		return copynesd_reply(client, copynes_nes_on(d->cn) ? "ok 1" : "ok 0", -1);
+	if(strcmp(req, "reset") == 0)
+		return copynesd_reset(d, client, args);
+	if(strcmp(req, "dump") == 0)
+		return copynesd_dump(d, client, args);
+
+	return copynesd_reply(client, "err unknown request", -1);
+}
+
+
+/* answer one request from a client, returns -1 once it should be dropped */
+static int copynesd_serve(struct copynesd_s* d, int client)
+{
+	char req[MAX_MESSAGE];
+	ssize_t n = 0;
+
+	if((n = recv(client, req, sizeof(req) - 1, MSG_DONTWAIT)) < 0)
+		return ((errno == EAGAIN) || (errno == EINTR)) ? 0 : -1;
+
+	/* hung up */
+	if(n == 0)
+		return -1;
+
+	/* strip a trailing newline so the socket is easy to poke at by hand */
+	req[n] = '\0';
+	if(req[n - 1] == '\n')
+		req[n - 1] = '\0';
+
+	return copynesd_handle(d, client, req);
+}
+
+
+/* wait for new clients and requests, serving requests one at a time */
+static void copynesd_loop(struct copynesd_s* d)
+{
+	struct pollfd fds[MAX_CLIENTS + 1];
+	int nclients = 0;
+	int client = -1;
+	int i = 0;
+
+	while(running)
+	{
+		/* stop accepting while every slot is taken */
+		fds[0].fd = (nclients < MAX_CLIENTS) ? d->listener : -1;
+		fds[0].events = POLLIN;
+		for(i = 1; i <= nclients; i++)
+			fds[i].events = POLLIN;
+
+		if(poll(fds, nclients + 1, -1) < 0)
+		{
+			if(errno == EINTR)
+				continue;
+			break;
+		}
+
+		/* walk backwards so dropping a client doesn't skip one */
+		for(i = nclients; i > 0; i--)
+		{
+			if(fds[i].revents == 0)
+				continue;
+
+			if(!(fds[i].revents & POLLIN) || (copynesd_serve(d, fds[i].fd) < 0))
+			{
+				close(fds[i].fd);
+				fds[i] = fds[nclients--];
+			}
+		}
+
+		if(fds[0].revents & POLLIN)
+		{
+			if((client = accept4(d->listener, 0, 0, SOCK_CLOEXEC)) >= 0)
+			{
+				nclients++;
+				fds[nclients].fd = client;
+				fds[nclients].revents = 0;
+			}
+			else if((errno != EINTR) && (errno != EAGAIN) && (errno != ECONNABORTED))
+				break;
+		}
+	}
+
+	for(i = 1; i <= nclients; i++)
+		close(fds[i].fd);
+}
+
+
+static int copynesd_listen(struct copynesd_s* d)
+{
+	struct sockaddr_un addr;
+
+	if(strlen(d->socket_path) >= sizeof(addr.sun_path))
+		return -1;
+
+	if((d->listener = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0)) < 0)
+		return -1;
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, d->socket_path);
+
+	/* clear out a stale socket from a previous run */
+	unlink(d->socket_path);
+
+	if((bind(d->listener, (struct sockaddr*)&addr, sizeof(addr)) < 0) ||
+	   (listen(d->listener, 8) < 0))
+	{
+		close(d->listener);
+		return -1;
+	}
+
+	return 0;
+}
+
+
+static void copynesd_usage(const char* argv0)
+{
+	fprintf(stderr, "usage: %s [-s socket] <data device> <control device>\n", argv0);
+}
+
+
+int main(int argc, char** argv)
+{
+	struct copynesd_s d;
+	struct sigaction sa;
+	int opt = 0;
+
+	memset(&d, 0, sizeof(d));
+	d.listener = -1;
+	d.socket_path = DEFAULT_SOCKET_PATH;
+
+	while((opt = getopt(argc, argv, "s:h")) != -1)
+	{
+		switch(opt)
+		{
+			case 's':
+				d.socket_path = optarg;
+				break;
+			default:
+				copynesd_usage(argv[0]);
+				return 1;
+		}
+	}
+
+	if((argc - optind) != 2)
+	{
+		copynesd_usage(argv[0]);
+		return 1;
+	}
+
+	if((shutdown_cancel = copynes_cancel_new()) == 0)
+		return 1;
+
+	/* shut down cleanly; no SA_RESTART so poll gets interrupted */
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = copynesd_signal;
+	sigaction(SIGINT, &sa, 0);
+	sigaction(SIGTERM, &sa, 0);
+	signal(SIGPIPE, SIG_IGN);
+
+	/* open and configure the CopyNES once for the life of the daemon */
+	if((d.cn = copynes_new()) == 0)
+		return 1;
+
+	if(copynes_open(d.cn, argv[optind], argv[optind + 1]) < 0)
+	{
+		fprintf(stderr, "%s: %s\n", argv[0], copynes_error_string(d.cn));
+		free(d.cn);
+		return 1;
+	}
+	copynes_set_cancel(d.cn, shutdown_cancel);
+
+	if(copynesd_listen(&d) < 0)
+	{
+		fprintf(stderr, "%s: failed to listen on %s: %s\n", argv[0], d.socket_path, strerror(errno));
+		copynes_free(d.cn);
+		return 1;
+	}
+
+	copynesd_loop(&d);
+
+	close(d.listener);
+	unlink(d.socket_path);
+
+	/* copynes_close shouldn't trip over the cancel */
+	copynes_set_cancel(d.cn, 0);
+	copynes_free(d.cn);
+	copynes_cancel_free(shutdown_cancel);
+
+	return 0;
+}
@@ -0,0 +1,61 @@
+#!/bin/sh
+#
+# check_sdt.sh
+# Copyright (C) David Huseby 2009 <dave@linuxprogrammer.org>
+#
+# This program is free software; you can redistribute it and/or
+# modify it under the terms of the GNU Lesser General Public
+# License as published by the Free Software Foundation; either
+# version 2.1 of the License, or (at your option) any later version.
+#
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+# Lesser General Public License for more details.
+#
+# You should have received a copy of the GNU Lesser General Public
+# License along with main.c; if not, write to the Free Software
+# Foundation, Inc., 51 Franklin Street, Fifth Floor Boston, MA 02110-1301,  USA
+#
+# checks that a program linking libcopynes built with sys/sdt.h carries a
+# stapsdt note for every probe and that each one has its semaphore in the
+# .probes section, which is what lets a tracer turn the probe timing on
+#
+# usage: check_sdt.sh <readelf> <program>
+
+READELF="$1"
+PROG="$2"
+FAILED=0
+
+NOTES=$("$READELF" -n "$PROG") || exit 1
+
+for NAME in packet_state read_start read write plugin_load plugin_run reset
+do
+	if ! echo "$NOTES" | grep -q "Name: $NAME\$"
+	then
+		echo "no stapsdt note for $NAME"
+		FAILED=1
+	fi
+done
+
+# .probes start and size
+PROBES=$("$READELF" -SW "$PROG" | sed -n 's/.* \.probes *PROGBITS *\([0-9a-f]*\) [0-9a-f]* \([0-9a-f]*\) .*/\1 \2/p')
+if [ -z "$PROBES" ]
+then
+	echo "no .probes section"
+	exit 1
+fi
+START=$((0x${PROBES% *}))
+END=$((START + 0x${PROBES#* }))
+
+for SEM in $(echo "$NOTES" | sed -n 's/.*Semaphore: 0x\([0-9a-f]*\).*/\1/p')
+do
+	ADDR=$((0x$SEM))
+	if [ "$ADDR" -lt "$START" ] || [ "$ADDR" -ge "$END" ]
+	then
+		echo "semaphore 0x$SEM is outside .probes"
+		FAILED=1
+	fi
+done
+
+exit $FAILED
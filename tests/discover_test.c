@@ -0,0 +1,231 @@
+/* -*- Mode: C; indent-tabs-mode: t; c-basic-offset: 4; tab-width: 4 -*- */
+/*
+ * discover_test.c
+ * Copyright (C) David Huseby 2009 <dave@linuxprogrammer.org>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with main.c; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor Boston, MA 02110-1301,  USA
+ */
+
+/*
+ * Runs copynes_discover against a fake sysfs tree built in a temporary
+ * directory:
+ *
+ *   1-1  0403:6010 "CN0001" "CopyNES"        ttyUSB0 (if 0), ttyUSB1 (if 1)
+ *   1-2  0403:6010 "FT4X7Q" "Dual RS232-HS"  ttyUSB3 (if 0), ttyUSB2 (if 1)
+ *   1-3  0403:6001 "A9XK2"  "FT232R UART"    ttyUSB4 (if 0)
+ *   1-4  0403:6010 "CN0002" "CopyNES"        ttyUSB5 (if 1) only
+ *   ttyS0, not USB at all
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "copynes_discover.h"
+
+static int failed = 0;
+
+#define CHECK(cond) \
+	do { if(!(cond)) { fprintf(stderr, "%s:%d: %s\n", __FILE__, __LINE__, #cond); failed++; } } while(0)
+
+static char root[PATH_MAX];
+
+
+static void make_dir(const char* rel)
+{
+	char path[PATH_MAX];
+	char* p = 0;
+
+	snprintf(path, sizeof(path), "%s/%s", root, rel);
+	for(p = path + strlen(root) + 1; (p = strchr(p, '/')) != 0; p++)
+	{
+		*p = '\0';
+		mkdir(path, 0755);
+		*p = '/';
+	}
+	mkdir(path, 0755);
+}
+
+
+static void make_attr(const char* dir, const char* attr, const char* value)
+{
+	char path[PATH_MAX];
+	FILE* f = 0;
+
+	snprintf(path, sizeof(path), "%s/%s/%s", root, dir, attr);
+	if((f = fopen(path, "w")) != 0)
+	{
+		fprintf(f, "%s\n", value);
+		fclose(f);
+	}
+}
+
+
+static void make_usb(const char* port, const char* vid, const char* pid, const char* serial, const char* product)
+{
+	char dir[PATH_MAX];
+
+	snprintf(dir, sizeof(dir), "sys/devices/usb1/%s", port);
+	make_dir(dir);
+	make_attr(dir, "idVendor", vid);
+	make_attr(dir, "idProduct", pid);
+	make_attr(dir, "serial", serial);
+	make_attr(dir, "product", product);
+}
+
+
+/* a tty on interface ifnum of the device on port, plus its class link */
+static void make_tty(const char* port, int ifnum, const char* tty)
+{
+	char dir[PATH_MAX];
+	char num[8];
+	char link[PATH_MAX];
+	char target[PATH_MAX];
+
+	snprintf(dir, sizeof(dir), "sys/devices/usb1/%s/%s:1.%d", port, port, ifnum);
+	make_dir(dir);
+	snprintf(num, sizeof(num), "%02x", ifnum);
+	make_attr(dir, "bInterfaceNumber", num);
+	snprintf(dir, sizeof(dir), "sys/devices/usb1/%s/%s:1.%d/%s", port, port, ifnum, tty);
+	make_dir(dir);
+
+	snprintf(dir, sizeof(dir), "sys/class/tty/%s", tty);
+	make_dir(dir);
+	snprintf(link, sizeof(link), "%s/sys/class/tty/%s/device", root, tty);
+	snprintf(target, sizeof(target), "../../../devices/usb1/%s/%s:1.%d/%s", port, port, ifnum, tty);
+	CHECK(symlink(target, link) == 0);
+}
+
+
+static void make_tree()
+{
+	char link[PATH_MAX];
+
+	make_dir("dev");
+
+	make_usb("1-1", "0403", "6010", "CN0001", "CopyNES");
+	make_tty("1-1", 0, "ttyUSB0");
+	make_tty("1-1", 1, "ttyUSB1");
+
+	/* numbered the other way around, the interface decides */
+	make_usb("1-2", "0403", "6010", "FT4X7Q", "Dual RS232-HS");
+	make_tty("1-2", 0, "ttyUSB3");
+	make_tty("1-2", 1, "ttyUSB2");
+
+	make_usb("1-3", "0403", "6001", "A9XK2", "FT232R UART");
+	make_tty("1-3", 0, "ttyUSB4");
+
+	make_usb("1-4", "0403", "6010", "CN0002", "CopyNES");
+	make_tty("1-4", 1, "ttyUSB5");
+
+	make_dir("sys/devices/platform/serial8250/ttyS0");
+	make_dir("sys/class/tty/ttyS0");
+	snprintf(link, sizeof(link), "%s/sys/class/tty/ttyS0/device", root);
+	CHECK(symlink("../../../devices/platform/serial8250/ttyS0", link) == 0);
+}
+
+
+static void check_device(const struct copynes_device_s* dev, const char* port, const char* data, const char* control, int stock_ids)
+{
+	char path[PATH_MAX];
+
+	CHECK(strcmp(dev->port, port) == 0);
+	snprintf(path, sizeof(path), "%s/dev/%s", root, data);
+	CHECK(strcmp(dev->data_device, path) == 0);
+	snprintf(path, sizeof(path), "%s/dev/%s", root, control);
+	CHECK(strcmp(dev->control_device, path) == 0);
+	CHECK(dev->stock_ids == stock_ids);
+}
+
+
+int main()
+{
+	struct copynes_device_s devs[8];
+	char sys[PATH_MAX];
+	char dev[PATH_MAX];
+	char cmd[PATH_MAX + 16];
+	int n = 0;
+
+	snprintf(root, sizeof(root), "%s/copynes-discover-XXXXXX", (getenv("TMPDIR") != 0) ? getenv("TMPDIR") : "/tmp");
+	if(mkdtemp(root) == 0)
+	{
+		perror("mkdtemp");
+		return 1;
+	}
+
+	make_tree();
+	snprintf(sys, sizeof(sys), "%s/sys", root);
+	snprintf(dev, sizeof(dev), "%s/dev", root);
+	copynes_discover_set_root(sys, dev);
+
+	/* out of the box every FT2232 with both channels shows up, flagged */
+	memset(devs, 0, sizeof(devs));
+	n = copynes_discover(devs, 8);
+	CHECK(n == 2);
+	if(n == 2)
+	{
+		check_device(&devs[0], "1-1", "ttyUSB0", "ttyUSB1", 1);
+		CHECK(strcmp(devs[0].serial, "CN0001") == 0);
+		CHECK(strcmp(devs[0].product, "CopyNES") == 0);
+		check_device(&devs[1], "1-2", "ttyUSB3", "ttyUSB2", 1);
+	}
+
+	/* max only limits what is copied */
+	CHECK(copynes_discover(devs, 1) == 2);
+
+	/* a product prefix picks out the CopyNES, which isn't a guess anymore */
+	copynes_discover_set_match(DISCOVER_VID, DISCOVER_PID, 0, "Copy");
+	memset(devs, 0, sizeof(devs));
+	CHECK((n = copynes_discover(devs, 8)) == 1);
+	if(n == 1)
+		check_device(&devs[0], "1-1", "ttyUSB0", "ttyUSB1", 0);
+
+	/* so does a serial number prefix */
+	copynes_discover_set_match(DISCOVER_VID, DISCOVER_PID, "FT4", 0);
+	memset(devs, 0, sizeof(devs));
+	CHECK((n = copynes_discover(devs, 8)) == 1);
+	if(n == 1)
+		check_device(&devs[0], "1-2", "ttyUSB3", "ttyUSB2", 0);
+
+	/* both have to match */
+	copynes_discover_set_match(DISCOVER_VID, DISCOVER_PID, "FT4", "Copy");
+	CHECK(copynes_discover(devs, 8) == 0);
+
+	/* a single channel chip is never paired up */
+	copynes_discover_set_match(0x0403, 0x6001, 0, 0);
+	CHECK(copynes_discover(devs, 8) == 0);
+
+	/* nor is a CopyNES missing its data channel */
+	copynes_discover_set_match(DISCOVER_VID, DISCOVER_PID, "CN0002", 0);
+	CHECK(copynes_discover(devs, 8) == 0);
+
+	/* no sysfs at all */
+	copynes_discover_set_match(DISCOVER_VID, DISCOVER_PID, 0, 0);
+	copynes_discover_set_root(root, dev);
+	CHECK(copynes_discover(devs, 8) == -1);
+
+	copynes_discover_set_root(0, 0);
+
+	snprintf(cmd, sizeof(cmd), "rm -rf '%s'", root);
+	if(system(cmd) != 0)
+		fprintf(stderr, "couldn't remove %s\n", root);
+
+	return (failed > 0) ? 1 : 0;
+}